@@ -75,7 +75,7 @@ AVLNode *avl_fix_right(AVLNode *root)
 {
     if (avl_depth(root->right->right) < avl_depth(root->right->left))
     {
-        root->right = rotate_left(root->right);
+        root->right = rotate_right(root->right);
     }
     return rotate_left(root);
 }
@@ -91,7 +91,7 @@ AVLNode *avl_fix(AVLNode *node)
         AVLNode **from = NULL;
         if (node->parent)
         {
-            from = (node->parent->left == node) ? &node : &node->parent->right;
+            from = (node->parent->left == node) ? &node->parent->left : &node->parent->right;
         }
 
         if (l == r + 2)
@@ -161,3 +161,104 @@ AVLNode *avl_del(AVLNode *node)
         }
     }
 }
+
+AVLNode *avl_offset(AVLNode *node, int64_t offset)
+{
+    // Walks `offset` positions in sorted order, using the subtree counts
+    // to skip whole subtrees. Returns NULL when out of range.
+    int64_t pos = 0; // relative to the starting node
+    while (offset != pos)
+    {
+        if (pos < offset && pos + avl_cnt(node->right) >= offset)
+        {
+            // the target is inside the right subtree
+            node = node->right;
+            pos += avl_cnt(node->left) + 1;
+        }
+        else if (pos > offset && pos - avl_cnt(node->left) <= offset)
+        {
+            // the target is inside the left subtree
+            node = node->left;
+            pos -= avl_cnt(node->right) + 1;
+        }
+        else
+        {
+            // go to the parent
+            AVLNode *parent = node->parent;
+            if (!parent)
+            {
+                return NULL;
+            }
+            if (parent->right == node)
+            {
+                pos -= avl_cnt(node->left) + 1;
+            }
+            else
+            {
+                pos += avl_cnt(node->right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+int64_t avl_rank(AVLNode *node)
+{
+    // Number of nodes before this one in sorted order
+    int64_t rank = avl_cnt(node->left);
+    while (node->parent)
+    {
+        if (node->parent->right == node)
+        {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return rank;
+}
+
+AVLNode *avl_first(AVLNode *root)
+{
+    while (root && root->left)
+    {
+        root = root->left;
+    }
+    return root;
+}
+
+AVLNode *avl_last(AVLNode *root)
+{
+    while (root && root->right)
+    {
+        root = root->right;
+    }
+    return root;
+}
+
+// In-order successor, amortized O(1) when walking a range
+AVLNode *avl_next(AVLNode *node)
+{
+    if (node->right)
+    {
+        return avl_first(node->right);
+    }
+    while (node->parent && node->parent->right == node)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+AVLNode *avl_prev(AVLNode *node)
+{
+    if (node->left)
+    {
+        return avl_last(node->left);
+    }
+    while (node->parent && node->parent->left == node)
+    {
+        node = node->parent;
+    }
+    return node->parent;
+}
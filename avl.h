@@ -1,3 +1,9 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef AVL_H
+#define AVL_H
+
 struct AVLNode
 {
     uint32_t depth;
@@ -19,3 +25,14 @@ AVLNode *avl_fix_right(AVLNode *root);
 AVLNode *avl_fix(AVLNode *node);
 
 AVLNode *avl_del(AVLNode *node);
+
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+int64_t avl_rank(AVLNode *node);
+
+// range iteration
+AVLNode *avl_first(AVLNode *root);
+AVLNode *avl_last(AVLNode *root);
+AVLNode *avl_next(AVLNode *node);
+AVLNode *avl_prev(AVLNode *node);
+
+#endif
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+
+#include "avl.h"
+
+// Deep offset queries: avl_offset() jumping k positions versus walking
+// k times with avl_next(), plus avl_rank(), on one large tree.
+//
+// usage: bench_avl [nnodes]   (default 10M)
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+
+    // Nodes in sorted order, so each one is appended as the rightmost
+    std::vector<AVLNode> nodes(n);
+    AVLNode *root = NULL;
+    for (size_t i = 0; i < n; i++)
+    {
+        avl_init(&nodes[i]);
+        if (root)
+        {
+            AVLNode *last = avl_last(root);
+            last->right = &nodes[i];
+            nodes[i].parent = last;
+            root = avl_fix(&nodes[i]);
+        }
+        else
+        {
+            root = &nodes[i];
+        }
+    }
+    std::cout << "nodes " << n << ", depth " << avl_depth(root) << std::endl;
+
+    srand(1);
+    const size_t nquery = 100000;
+    std::vector<size_t> starts(nquery);
+    for (size_t i = 0; i < nquery; i++)
+    {
+        starts[i] = ((size_t)rand() * RAND_MAX + rand()) % n;
+    }
+
+    std::cout << "offset\tavl_offset ns\tavl_next walk ns" << std::endl;
+    for (size_t k = 1; k <= n / 2; k *= 10)
+    {
+        uint64_t t0 = get_monotonic_ns();
+        size_t sum = 0;
+        for (size_t i = 0; i < nquery; i++)
+        {
+            size_t from = starts[i] % (n - k);
+            AVLNode *node = avl_offset(&nodes[from], (int64_t)k);
+            sum += node == &nodes[from + k];
+        }
+        uint64_t t1 = get_monotonic_ns();
+        if (sum != nquery)
+        {
+            std::cerr << "wrong result" << std::endl;
+            abort();
+        }
+
+        // The linear walk is only sampled, it gets slow quickly
+        size_t nwalk = std::max<size_t>(1, std::min<size_t>(nquery, (100 << 20) / k / 64));
+        for (size_t i = 0; i < nwalk; i++)
+        {
+            AVLNode *node = &nodes[starts[i] % (n - k)];
+            for (size_t j = 0; j < k; j++)
+            {
+                node = avl_next(node);
+            }
+            sum += node != NULL;
+        }
+        uint64_t t2 = get_monotonic_ns();
+        std::cout << k << "\t" << (t1 - t0) / nquery << "\t\t" << (t2 - t1) / nwalk << std::endl;
+    }
+
+    uint64_t t0 = get_monotonic_ns();
+    int64_t total = 0;
+    for (size_t i = 0; i < nquery; i++)
+    {
+        total += avl_rank(&nodes[starts[i]]) - (int64_t)starts[i];
+    }
+    uint64_t t1 = get_monotonic_ns();
+    if (total != 0)
+    {
+        std::cerr << "wrong rank" << std::endl;
+        abort();
+    }
+    std::cout << "avl_rank " << (t1 - t0) / nquery << " ns" << std::endl;
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include "kvclient.h"
+
+// Multi-key command benchmark against a running server. For each batch
+// size, the same keys are read, written and removed three ways:
+//   single:   one request per round trip
+//   pipeline: `batch` single-key requests written together
+//   multi:    one mget/mset/mdel of `batch` keys
+// and the throughput is reported in keys per second.
+//
+// usage: bench_batch [keys] [value_size] [keys_per_run]
+
+static void die(const char *msg)
+{
+    std::cerr << msg << std::endl;
+    abort();
+}
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t rand64()
+{
+    static uint64_t s = 88172645463325252ull;
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    return s;
+}
+
+// Writes the queued requests and waits for all the responses
+static void roundtrip(KVConn &conn)
+{
+    while (!conn.pending.empty())
+    {
+        struct pollfd pfd = {conn.fd, POLLIN, 0};
+        pfd.events |= conn.want_write() ? POLLOUT : 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            die("poll()");
+        }
+        if ((pfd.revents & POLLOUT) && !conn.flush())
+        {
+            die(conn.error.c_str());
+        }
+        if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) && !conn.read())
+        {
+            die(conn.error.c_str());
+        }
+    }
+}
+
+enum
+{
+    OP_SET = 0,
+    OP_GET = 1,
+    OP_DEL = 2,
+};
+
+enum
+{
+    MODE_SINGLE = 0,
+    MODE_PIPELINE = 1,
+    MODE_MULTI = 2,
+};
+
+static const char *const k_single[] = {"set", "get", "del"};
+static const char *const k_multi[] = {"mset", "mget", "mdel"};
+
+struct Bench
+{
+    KVConn conn;
+    std::vector<std::string> names;
+    std::string value;
+    size_t errors = 0;
+    KVConn::Callback check;
+};
+
+// Runs `total` keys in batches of `batch` and returns keys per second
+static double bench_run(Bench &b, uint32_t op, uint32_t mode, size_t batch, size_t total)
+{
+    std::vector<std::string_view> args;
+    uint64_t start = get_monotonic_ns();
+    for (size_t done = 0; done < total; done += batch)
+    {
+        args.clear();
+        if (mode == MODE_MULTI)
+        {
+            args.push_back(k_multi[op]);
+        }
+        for (size_t i = 0; i < batch; i++)
+        {
+            std::string_view name = b.names[rand64() % b.names.size()];
+            if (mode != MODE_MULTI)
+            {
+                args.push_back(k_single[op]);
+            }
+            args.push_back(name);
+            if (op == OP_SET)
+            {
+                args.push_back(b.value);
+            }
+            if (mode == MODE_SINGLE)
+            {
+                b.conn.send(args.data(), args.size(), b.check);
+                roundtrip(b.conn);
+                args.clear();
+            }
+            else if (mode == MODE_PIPELINE)
+            {
+                b.conn.send(args.data(), args.size(), b.check);
+                args.clear();
+            }
+        }
+        if (mode == MODE_MULTI)
+        {
+            b.conn.send(args.data(), args.size(), b.check);
+        }
+        roundtrip(b.conn);
+    }
+    double secs = (double)(get_monotonic_ns() - start) / 1e9;
+    return (double)total / secs;
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t value_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 16;
+    size_t per_run = argc > 3 ? strtoul(argv[3], NULL, 10) : 200000;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+    {
+        die("connect()");
+    }
+
+    Bench b;
+    b.conn.attach(fd);
+    b.value.assign(value_size, 'v');
+    b.check = [&b](const KVValue &val) {
+        b.errors += val.type == SER_ERR;
+        for (const KVValue &v : val.arr)
+        {
+            b.errors += v.type == SER_ERR;
+        }
+    };
+    b.names.reserve(nkeys);
+    for (size_t i = 0; i < nkeys; i++)
+    {
+        b.names.push_back("key:" + std::to_string(i));
+    }
+
+    // load every key, so gets hit until the first del
+    std::vector<std::string_view> args;
+    for (size_t i = 0; i < nkeys; i += 1000)
+    {
+        args.assign(1, "mset");
+        for (size_t j = i; j < std::min(nkeys, i + 1000); j++)
+        {
+            args.push_back(b.names[j]);
+            args.push_back(b.value);
+        }
+        b.conn.send(args.data(), args.size(), b.check);
+        roundtrip(b.conn);
+    }
+
+    std::cout << nkeys << " keys, " << value_size << " byte values, " << per_run
+              << " keys per run, in keys/s" << std::endl;
+    std::cout << "batch op     single   pipeline      multi  multi/single" << std::endl;
+    char line[128];
+    for (size_t batch : {1, 10, 100, 1000})
+    {
+        for (uint32_t op : {OP_SET, OP_GET, OP_DEL})
+        {
+            // unbatched requests are slow, keep their run short
+            double single = bench_run(b, op, MODE_SINGLE, batch, per_run / 10);
+            double pipeline = bench_run(b, op, MODE_PIPELINE, batch, per_run);
+            double multi = bench_run(b, op, MODE_MULTI, batch, per_run);
+            snprintf(line, sizeof(line), "%5zu %-4s %10.0f %10.0f %10.0f %13.1f", batch,
+                     k_single[op], single, pipeline, multi, multi / single);
+            std::cout << line << std::endl;
+        }
+    }
+    if (b.errors)
+    {
+        std::cout << b.errors << " errors" << std::endl;
+    }
+    return 0;
+}
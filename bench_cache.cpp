@@ -0,0 +1,239 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+// Cache benchmark with a Zipfian key distribution.
+// Runs cache-aside against a running server: GET a key, and SET it on a
+// miss. Start the server with a memory limit smaller than the key space,
+// e.g. `server --maxmemory 16m --maxmemory-policy lfu`, and compare the
+// hit ratio and throughput of the policies.
+//
+// usage: bench_cache [ops] [keys] [value_size] [theta]
+
+const size_t k_max_msg = 4096;
+// Requests sent before reading the responses
+const size_t k_batch = 64;
+
+enum
+{
+    SER_NIL = 0,
+};
+
+static void die(const char *msg)
+{
+    std::cerr << msg << ": " << strerror(errno) << std::endl;
+    abort();
+}
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static int32_t read_full(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static void encode_req(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t p = (uint32_t)s.size();
+        out.append((char *)&p, 4);
+        out.append(s);
+    }
+}
+
+// Reads one response and returns its type tag
+static uint8_t read_res(int fd)
+{
+    char rbuf[4 + k_max_msg];
+    uint32_t len = 0;
+    if (read_full(fd, rbuf, 4))
+    {
+        die("read()");
+    }
+    memcpy(&len, rbuf, 4);
+    if (len < 1 || len > k_max_msg)
+    {
+        std::cerr << "bad response, is value_size too large?" << std::endl;
+        abort();
+    }
+    if (read_full(fd, &rbuf[4], len))
+    {
+        die("read()");
+    }
+    return (uint8_t)rbuf[4];
+}
+
+static uint64_t rand64()
+{
+    static uint64_t x = 88172645463325252ull;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 2685821657736338717ull;
+}
+
+// Zipfian ranks by inverting the CDF, rank 0 is the most popular
+struct Zipf
+{
+    std::vector<double> cdf;
+
+    Zipf(size_t n, double theta)
+    {
+        cdf.resize(n);
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += 1.0 / pow((double)(i + 1), theta);
+            cdf[i] = sum;
+        }
+        for (double &c : cdf)
+        {
+            c /= sum;
+        }
+    }
+
+    size_t next()
+    {
+        double u = (double)(rand64() >> 11) / (double)(1ull << 53);
+        size_t i = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return std::min(i, cdf.size() - 1);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    size_t nops = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t nkeys = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    size_t vsize = argc > 3 ? strtoul(argv[3], NULL, 10) : 100;
+    double theta = argc > 4 ? strtod(argv[4], NULL) : 0.99;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+    {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+    Zipf zipf(nkeys, theta);
+    std::string value(vsize, 'v');
+
+    // The first quarter warms the cache and is not counted
+    size_t nwarm = nops / 4;
+    size_t hits = 0;
+    size_t gets = 0;
+    uint64_t start = 0;
+    for (size_t done = 0; done < nops;)
+    {
+        if (done >= nwarm && start == 0)
+        {
+            start = get_monotonic_ns();
+            hits = gets = 0;
+        }
+
+        size_t n = std::min(k_batch, nops - done);
+        std::vector<std::string> keys(n);
+        std::string req;
+        for (size_t i = 0; i < n; i++)
+        {
+            keys[i] = "key:" + std::to_string(zipf.next());
+            encode_req(req, {"get", keys[i]});
+        }
+        if (write_all(fd, req.data(), req.size()))
+        {
+            die("write()");
+        }
+
+        // fill the misses in one more round trip
+        req.clear();
+        size_t nmiss = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (read_res(fd) != SER_NIL)
+            {
+                hits++;
+                continue;
+            }
+            encode_req(req, {"set", keys[i], value});
+            nmiss++;
+        }
+        if (write_all(fd, req.data(), req.size()))
+        {
+            die("write()");
+        }
+        for (size_t i = 0; i < nmiss; i++)
+        {
+            read_res(fd);
+        }
+
+        gets += n;
+        done += n;
+    }
+    uint64_t elapsed = get_monotonic_ns() - start;
+
+    std::cout << "keys\ttheta\tgets\thit%\tgets/s" << std::endl;
+    std::cout << nkeys << "\t" << theta << "\t" << gets << "\t"
+              << 100.0 * hits / std::max<size_t>(gets, 1) << "\t"
+              << (uint64_t)(gets * 1e9 / std::max<uint64_t>(elapsed, 1)) << std::endl;
+    close(fd);
+    return 0;
+}
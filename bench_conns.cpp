@@ -0,0 +1,207 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <string>
+
+// Connection scaling benchmark.
+// Opens N idle connections, then measures the per-request cost on one
+// active connection. With an O(active) event loop the cost stays flat as N grows.
+//
+// usage: bench_conns [requests] [n1 n2 ...]
+
+const size_t k_max_msg = 4096;
+// Ephemeral ports per source address are limited, so spread the idle
+// connections across several loopback addresses
+const size_t k_conns_per_addr = 20000;
+
+static void die(const char *msg)
+{
+    std::cerr << msg << ": " << strerror(errno) << std::endl;
+    abort();
+}
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static int32_t read_full(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int connect_from(uint32_t src_addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct sockaddr_in src = {};
+    src.sin_family = AF_INET;
+    src.sin_port = 0;
+    src.sin_addr.s_addr = htonl(src_addr);
+    if (bind(fd, (const sockaddr *)&src, sizeof(src)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void encode_req(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t p = (uint32_t)s.size();
+        out.append((char *)&p, 4);
+        out.append(s);
+    }
+}
+
+static void raise_fd_limit()
+{
+    struct rlimit rl = {};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t nreq = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+    std::vector<size_t> levels;
+    for (int i = 2; i < argc; i++)
+    {
+        levels.push_back(strtoul(argv[i], NULL, 10));
+    }
+    if (levels.empty())
+    {
+        levels = {100, 1000, 10000, 50000};
+    }
+
+    raise_fd_limit();
+
+    int active = connect_from(INADDR_LOOPBACK);
+    if (active < 0)
+    {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(active, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+    std::string req;
+    encode_req(req, {"get", "bench_conns"});
+
+    std::vector<int> idle;
+    std::cout << "conns\treqs\tns/req" << std::endl;
+    for (size_t target : levels)
+    {
+        while (idle.size() < target)
+        {
+            uint32_t src = INADDR_LOOPBACK + 1 + idle.size() / k_conns_per_addr;
+            int fd = connect_from(src);
+            if (fd < 0)
+            {
+                std::cerr << "stopped at " << idle.size()
+                          << " idle connections (check ulimit -n on both ends): "
+                          << strerror(errno) << std::endl;
+                break;
+            }
+            idle.push_back(fd);
+        }
+
+        char rbuf[4 + k_max_msg];
+        uint64_t start = get_monotonic_ns();
+        for (size_t i = 0; i < nreq; i++)
+        {
+            if (write_all(active, req.data(), req.size()))
+            {
+                die("write()");
+            }
+            uint32_t len = 0;
+            if (read_full(active, rbuf, 4))
+            {
+                die("read()");
+            }
+            memcpy(&len, rbuf, 4);
+            assert(len <= k_max_msg);
+            if (read_full(active, &rbuf[4], len))
+            {
+                die("read()");
+            }
+        }
+        uint64_t elapsed = get_monotonic_ns() - start;
+        std::cout << idle.size() << "\t" << nreq << "\t" << elapsed / nreq << std::endl;
+
+        if (idle.size() < target)
+        {
+            break;
+        }
+    }
+
+    for (int fd : idle)
+    {
+        close(fd);
+    }
+    close(active);
+    return 0;
+}
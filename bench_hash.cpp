@@ -0,0 +1,66 @@
+#include <iostream>
+#include <string>
+#include <time.h>
+
+#include "hash.h"
+
+// Hash throughput over key lengths, old byte-at-a-time hash vs str_hash
+//
+// usage: bench_hash
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t fnv_hash(const uint8_t *data, size_t len)
+{
+    uint64_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+template <class F>
+static double measure(const std::string &buf, size_t len, F hash)
+{
+    // Roughly 256 MB hashed per measurement
+    size_t iters = (256 << 20) / len;
+    uint64_t sink = 0;
+    uint64_t start = get_monotonic_ns();
+    for (size_t i = 0; i < iters; i++)
+    {
+        // Depend on the previous result so calls cannot overlap freely
+        size_t off = sink & 63;
+        sink += hash((const uint8_t *)&buf[off], len);
+    }
+    uint64_t ns = get_monotonic_ns() - start;
+    if (sink == 42)
+    {
+        std::cout << "";
+    }
+    return (double)(iters * len) / ns; // bytes per ns = GB/s
+}
+
+int main()
+{
+    hash_seed_init();
+    std::string buf(1024 + 64, 'k');
+    for (size_t i = 0; i < buf.size(); i++)
+    {
+        buf[i] = (char)(i * 131);
+    }
+
+    std::cout << "len\tfnv GB/s\tstr_hash GB/s" << std::endl;
+    for (size_t len = 8; len <= 1024; len *= 2)
+    {
+        double fnv = measure(buf, len, fnv_hash);
+        double fast = measure(buf, len, str_hash);
+        std::cout << len << "\t" << fnv << "\t\t" << fast << std::endl;
+    }
+    return 0;
+}
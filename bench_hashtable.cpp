@@ -0,0 +1,186 @@
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include "hashtable.h"
+#include "flatmap.h"
+
+// Compares the chained HMap against the open addressing FlatMap, and
+// HMap lookups one at a time against hm_lookup_batch().
+// Nodes carry an integer key so that only the table itself is measured.
+//
+// usage: bench_hashtable [nkeys ...]   (default 1M 10M, 100M needs ~8 GB)
+
+#define container_of(ptr, type, member) ({                  \
+    typeof(  ((type *)0)->member ) *__mptr = ptr;           \
+    (type *)( (size_t) __mptr - offsetof(type, member)); })
+
+struct BNode
+{
+    HNode node;
+    uint64_t key;
+};
+
+static uint64_t get_monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x)
+{
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static bool bnode_eq(HNode *node, const HKey *key)
+{
+    return container_of(node, BNode, node)->key == *(const uint64_t *)key->data;
+}
+
+static HKey make_key(const uint64_t *k)
+{
+    HKey key;
+    key.data = (const uint8_t *)k;
+    key.len = sizeof(*k);
+    key.hcode = mix(*k);
+    return key;
+}
+
+template <class Insert, class Lookup>
+static void run(const char *name, size_t n, std::vector<BNode> &nodes,
+                const std::vector<uint64_t> &order, Insert insert, Lookup lookup)
+{
+    uint64_t t0 = get_monotonic_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        nodes[i].node.next = NULL;
+        nodes[i].node.hcode = mix(nodes[i].key);
+        insert(&nodes[i].node);
+    }
+    uint64_t t1 = get_monotonic_ns();
+
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t k = order[i];
+        HKey key = make_key(&k);
+        found += lookup(&key) != NULL;
+    }
+    uint64_t t2 = get_monotonic_ns();
+
+    size_t missed = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t k = order[i] + n; // never inserted
+        HKey key = make_key(&k);
+        missed += lookup(&key) == NULL;
+    }
+    uint64_t t3 = get_monotonic_ns();
+
+    if (found != n || missed != n)
+    {
+        std::cerr << name << ": wrong result" << std::endl;
+        abort();
+    }
+    std::cout << name << "\t" << n
+              << "\tinsert " << (t1 - t0) / n << " ns"
+              << "\thit " << (t2 - t1) / n << " ns"
+              << "\tmiss " << (t3 - t2) / n << " ns" << std::endl;
+}
+
+// Lookups of the keys inserted by run(), `batch` per hm_lookup_batch() call
+static void run_batch(HMap &hm, size_t n, size_t batch, const std::vector<uint64_t> &order)
+{
+    std::vector<uint64_t> k(batch);
+    std::vector<HKey> keys(batch);
+    std::vector<HNode *> out(batch);
+    uint64_t times[2] = {0, 0};
+    size_t counts[2] = {0, 0}; // found, then missed
+    for (size_t miss = 0; miss < 2; miss++)
+    {
+        uint64_t t0 = get_monotonic_ns();
+        for (size_t i = 0; i < n; i += batch)
+        {
+            size_t m = std::min(batch, n - i);
+            for (size_t j = 0; j < m; j++)
+            {
+                k[j] = order[i + j] + (miss ? n : 0);
+                keys[j] = make_key(&k[j]);
+            }
+            hm.hm_lookup_batch(keys.data(), m, &bnode_eq, out.data());
+            for (size_t j = 0; j < m; j++)
+            {
+                counts[miss] += (out[j] != NULL) != (miss == 1);
+            }
+        }
+        times[miss] = get_monotonic_ns() - t0;
+    }
+
+    if (counts[0] != n || counts[1] != n)
+    {
+        std::cerr << "HMap batch: wrong result" << std::endl;
+        abort();
+    }
+    std::cout << "HMap x" << batch << "\t" << n
+              << "\t\t\thit " << times[0] / n << " ns"
+              << "\tmiss " << times[1] / n << " ns" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; i++)
+    {
+        sizes.push_back(strtoull(argv[i], NULL, 10));
+    }
+    if (sizes.empty())
+    {
+        sizes = {1000000, 10000000};
+    }
+
+    for (size_t n : sizes)
+    {
+        std::vector<BNode> nodes(n);
+        std::vector<uint64_t> order(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            nodes[i].key = i;
+            order[i] = i;
+        }
+        // Random probe order so that lookups miss the cache like real traffic
+        srand(1);
+        for (size_t i = n - 1; i > 0; i--)
+        {
+            std::swap(order[i], order[(size_t)(mix(rand()) % (i + 1))]);
+        }
+
+        HMap hm;
+        run(
+            "HMap", n, nodes, order,
+            [&](HNode *node) { hm.hm_insert(node); },
+            [&](const HKey *key) { return hm.hm_lookup(key, &bnode_eq); });
+        for (size_t batch : {4, 16, 64})
+        {
+            run_batch(hm, n, batch, order);
+        }
+        free(hm.ht1.tab);
+        free(hm.ht2.tab);
+
+        FlatMap fm;
+        run(
+            "FlatMap", n, nodes, order,
+            [&](HNode *node) { fm.fm_insert(node); },
+            [&](const HKey *key) { return fm.fm_lookup(key, &bnode_eq); });
+        fm.t1.f_free();
+        fm.t2.f_free();
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+// Memory benchmark: the server's RSS per key.
+// Inserts keys with SET into a running server and reads its resident set
+// size from /proc before and after, so any build of the server can be
+// compared. Start the server without a snapshot to load. With "int" as
+// the value size, the values are the key numbers.
+//
+// usage: bench_memory server_pid [keys] [key_size] [value_size|int]
+
+const size_t k_max_msg = 4096;
+// Requests sent before reading the responses
+const size_t k_batch = 1000;
+
+static void die(const char *msg)
+{
+    std::cerr << msg << ": " << strerror(errno) << std::endl;
+    abort();
+}
+
+static int32_t read_full(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0)
+        {
+            return -1;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
+static void encode_req(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t p = (uint32_t)s.size();
+        out.append((char *)&p, 4);
+        out.append(s);
+    }
+}
+
+static void read_res(int fd)
+{
+    char rbuf[4 + k_max_msg];
+    uint32_t len = 0;
+    if (read_full(fd, rbuf, 4))
+    {
+        die("read()");
+    }
+    memcpy(&len, rbuf, 4);
+    if (len < 1 || len > k_max_msg || read_full(fd, &rbuf[4], len))
+    {
+        die("bad response");
+    }
+}
+
+static uint64_t rss_bytes(const char *pid)
+{
+    std::string path = std::string("/proc/") + pid + "/statm";
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp)
+    {
+        die("fopen() statm");
+    }
+    unsigned long vsz = 0, rss = 0;
+    if (fscanf(fp, "%lu %lu", &vsz, &rss) != 2)
+    {
+        die("fscanf() statm");
+    }
+    fclose(fp);
+    return (uint64_t)rss * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: bench_memory server_pid [keys] [key_size] [value_size|int]" << std::endl;
+        return 1;
+    }
+    const char *pid = argv[1];
+    size_t nkeys = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    size_t ksize = argc > 3 ? strtoul(argv[3], NULL, 10) : 20;
+    bool ints = argc > 4 && std::string(argv[4]) == "int";
+    size_t vsize = argc > 4 && !ints ? strtoul(argv[4], NULL, 10) : 8;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+    {
+        die("connect()");
+    }
+
+    uint64_t before = rss_bytes(pid);
+    std::string value(vsize, 'v');
+    for (size_t done = 0; done < nkeys;)
+    {
+        size_t n = std::min(k_batch, nkeys - done);
+        std::string req;
+        for (size_t i = 0; i < n; i++)
+        {
+            // unique keys padded to ksize
+            std::string key = "key:" + std::to_string(done + i);
+            key.resize(std::max(ksize, key.size()), '.');
+            encode_req(req, {"set", key, ints ? std::to_string(done + i) : value});
+        }
+        if (write_all(fd, req.data(), req.size()))
+        {
+            die("write()");
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            read_res(fd);
+        }
+        done += n;
+    }
+    uint64_t after = rss_bytes(pid);
+
+    double per_key = (double)(after - before) / (double)std::max<size_t>(nkeys, 1);
+    std::cout << "keys\tkey\tvalue\tbytes/key\tMB/M keys" << std::endl;
+    std::cout << nkeys << "\t" << ksize << "\t" << (ints ? "int" : std::to_string(vsize)) << "\t" << per_key << "\t"
+              << per_key * 1e6 / (1 << 20) << std::endl;
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+
+const size_t k_min_buffer = 1024;
+
+Buffer::~Buffer()
+{
+    free(buf);
+}
+
+uint8_t *Buffer::reserve(size_t n)
+{
+    // Returns room for at least n bytes at the tail, see commit()
+    if (cap - tail >= n)
+    {
+        return buf + tail;
+    }
+
+    size_t used = tail - head;
+    if (head > 0 && cap - used >= n && used <= cap / 2)
+    {
+        // Reclaim the consumed prefix. Only done when the live data is
+        // small, so the cost is amortized over the bytes consumed.
+        memmove(buf, buf + head, used);
+        head = 0;
+        tail = used;
+        return buf + tail;
+    }
+
+    size_t ncap = cap ? cap : k_min_buffer;
+    while (ncap < used + n)
+    {
+        ncap *= 2;
+    }
+    uint8_t *nbuf = (uint8_t *)malloc(ncap);
+    if (!nbuf)
+    {
+        abort();
+    }
+    if (used)
+    {
+        memcpy(nbuf, buf + head, used);
+    }
+    free(buf);
+    buf = nbuf;
+    cap = ncap;
+    head = 0;
+    tail = used;
+    return buf + tail;
+}
+
+void Buffer::commit(size_t n)
+{
+    assert(tail + n <= cap);
+    tail += n;
+}
+
+void Buffer::append(const uint8_t *data, size_t n)
+{
+    memcpy(reserve(n), data, n);
+    commit(n);
+}
+
+void Buffer::consume(size_t n)
+{
+    assert(n <= tail - head);
+    head += n;
+    if (head == tail)
+    {
+        head = tail = 0;
+    }
+}
+
+void Buffer::release()
+{
+    assert(head == tail);
+    free(buf);
+    buf = NULL;
+    cap = head = tail = 0;
+}
@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+// Contiguous byte queue. Bytes are appended at the tail and consumed from
+// the head, so callers can parse straight out of data() without copying.
+// Storage grows on demand and is given back with release() once drained.
+class Buffer
+{
+public:
+    uint8_t *buf;
+    size_t cap;
+    size_t head;
+    size_t tail;
+
+    Buffer()
+    {
+        buf = NULL;
+        cap = head = tail = 0;
+    }
+    ~Buffer();
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    uint8_t *data() { return buf + head; }
+    size_t size() { return tail - head; }
+
+    uint8_t *reserve(size_t n);
+    void commit(size_t n);
+    void append(const uint8_t *data, size_t n);
+    void consume(size_t n);
+    void release();
+};
+
+#endif
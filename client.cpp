@@ -7,18 +7,20 @@
 #include <netinet/ip.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <charconv>
+#include <algorithm>
+#include <deque>
+#include <thread>
 #include <vector>
+#include <string>
+#include <stdlib.h>
+#include "stats.h"
+#include "kvclient.h"
 
-enum
-{
-    SER_NIL = 0,
-    SER_ERR = 1,
-    SER_STR = 2,
-    SER_INT = 3,
-    SER_ARR = 4,
-};
-
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
 
 static void msg(const char *msg)
 {
@@ -28,7 +30,12 @@ static void msg(const char *msg)
 static void die(const char *msg)
 {
     int err = errno;
-    std::cerr << msg << std::endl;
+    std::cerr << msg;
+    if (err)
+    {
+        std::cerr << ": " << strerror(err);
+    }
+    std::cerr << std::endl;
     abort();
 }
 
@@ -52,327 +59,555 @@ static void fd_set_nb(int fd)
     }
 }
 
-static int32_t read_full(int fd, char *buf, size_t n)
+// Prints a response the way the server shapes it, arrays nested
+static void print_value(const KVValue &val)
 {
-    while (n > 0)
+    switch (val.type)
     {
-        ssize_t rv = read(fd, buf, n); // Read exactly n bytes into buf
-        if (rv <= 0)
+    case SER_NIL:
+        std::cout << "(nil)" << std::endl;
+        break;
+    case SER_ERR:
+        std::cout << "(err) " << val.str << std::endl;
+        break;
+    case SER_STR:
+        std::cout << "(str) " << val.str << std::endl;
+        break;
+    case SER_INT:
+        std::cout << "(int) " << val.i << std::endl;
+        break;
+    case SER_DBL:
+        std::cout << "(dbl) " << val.d << std::endl;
+        break;
+    case SER_ARR:
+        std::cout << "(arr) len=" << val.arr.size() << std::endl;
+        for (const KVValue &v : val.arr)
         {
-            return -1;
+            print_value(v);
         }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
+        std::cout << "(arr) end" << std::endl;
+        break;
     }
-    return 0;
 }
 
-static int32_t write_all(int fd, char *buf, size_t n)
+// Benchmark mode, like redis-benchmark. Each thread runs an epoll loop
+// over its share of the connections and keeps `pipeline` requests in
+// flight on each of them: a new request goes out as soon as a response
+// comes back. Latency is measured from queueing a request to parsing its
+// response.
+struct BenchConf
 {
-    while (n > 0)
+    size_t conns = 50;
+    size_t threads = 1;
+    size_t requests = 100000;
+    size_t pipeline = 1;
+    size_t keys = 100000;
+    size_t value_size = 16;
+    uint32_t mix[3] = {90, 10, 0}; // get, set, del weights
+    bool zipf = false;
+    double theta = 0.99;
+    bool json = false;
+};
+
+// Zipfian ranks by inverting the CDF, rank 0 is the most popular
+struct Zipf
+{
+    std::vector<double> cdf;
+
+    Zipf(size_t n, double theta)
     {
-        ssize_t rv = write(fd, buf, n); // Write exactly n bytes into buf
-        if (rv <= 0)
+        cdf.resize(n);
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += 1.0 / pow((double)(i + 1), theta);
+            cdf[i] = sum;
+        }
+        for (double &c : cdf)
         {
-            return -1;
+            c /= sum;
         }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
     }
-    return 0;
+
+    size_t next(double u) const
+    {
+        size_t i = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return std::min(i, cdf.size() - 1);
+    }
+};
+
+enum
+{
+    BENCH_GET = 0,
+    BENCH_SET = 1,
+    BENCH_DEL = 2,
+};
+
+struct BenchReq
+{
+    uint64_t start = 0; // when it was queued
+    uint32_t op = BENCH_GET;
+};
+
+struct BenchConn
+{
+    int fd = -1;
+    std::string wbuf;
+    size_t wbuf_sent = 0;
+    std::string rbuf;
+    std::deque<BenchReq> sent; // requests in flight
+    bool want_write = false;
+};
+
+// Results of one thread, merged at the end
+struct BenchResult
+{
+    Histogram latency; // ticks
+    uint64_t done = 0;
+    uint64_t errors = 0;
+    uint64_t hits = 0;   // GETs that found a value
+    uint64_t misses = 0;
+};
+
+struct BenchThread
+{
+    const BenchConf *conf = NULL;
+    const Zipf *zipf = NULL;
+    std::string value;
+    uint64_t rng = 0;
+    uint64_t quota = 0;  // requests this thread sends
+    uint64_t issued = 0;
+    int epfd = -1;
+    std::vector<BenchConn> conns;
+    BenchResult *res = NULL;
+};
+
+static uint64_t bench_rand(BenchThread *t)
+{
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ull;
 }
 
-// static int32_t send_req(int fd, const char *text)
-// {
-//     uint32_t len = (uint32_t)strlen(text);
-//     if (len > k_max_msg)
-//     {
-//         return -1;
-//     }
-
-//     char wbuf[4 + k_max_msg];
-//     memcpy(wbuf, &len, 4); // assume little endian
-//     memcpy(wbuf + 4, text, len);
-
-//     if (int32_t err = write_all(fd, wbuf, 4 + len))
-//     {
-//         return err;
-//     }
-//     return 0;
-// }
-
-static int32_t send_req(int fd, std::vector<std::string> &cmd)
+// Queues one request picked from the mix
+static void bench_queue(BenchThread *t, BenchConn *c)
 {
-    uint32_t len = 4;
-    for (const std::string &s : cmd)
+    const BenchConf &conf = *t->conf;
+    size_t k = 0;
+    if (t->zipf)
     {
-        len += 4 + s.size();
+        k = t->zipf->next((double)(bench_rand(t) >> 11) / (double)(1ull << 53));
     }
-    if (len > k_max_msg)
+    else
     {
-        return -1;
+        k = bench_rand(t) % conf.keys;
     }
-
-    char wbuf[4 + k_max_msg];
-    memcpy(&wbuf[0], &len, 4);
-    uint32_t n = cmd.size();
-    memcpy(&wbuf[4], &n, 4);
-    size_t cur = 8;
-    for (const std::string &s : cmd)
+    char key[32] = "key:";
+    char *end = std::to_chars(key + 4, key + sizeof(key), k).ptr;
+    std::string_view name(key, end - key);
+
+    uint32_t total = conf.mix[0] + conf.mix[1] + conf.mix[2];
+    uint32_t r = (uint32_t)(bench_rand(t) % total);
+    BenchReq req;
+    req.op = r < conf.mix[0] ? BENCH_GET : r < conf.mix[0] + conf.mix[1] ? BENCH_SET : BENCH_DEL;
+    if (req.op == BENCH_GET)
+    {
+        kv_encode(c->wbuf, {"get", name});
+    }
+    else if (req.op == BENCH_SET)
+    {
+        kv_encode(c->wbuf, {"set", name, t->value});
+    }
+    else
     {
-        uint32_t p = (uint32_t)s.size();
-        memcpy(&wbuf[cur], &p, 4);
-        memcpy(&wbuf[cur + 4], s.data(), s.size());
-        cur += 4 + s.size();
+        kv_encode(c->wbuf, {"del", name});
     }
-    return write_all(fd, wbuf, 4 + len);
+    req.start = tsc_now();
+    c->sent.push_back(req);
+    t->issued++;
 }
 
-// static int32_t read_res(int fd, const char *text)
-// {
-//     // 4 bytes header
-//     char rbuf[4 + k_max_msg + 1];
-//     errno = 0;
-//     int32_t err = read_full(fd, rbuf, 4);
-//     if (err)
-//     {
-//         if (errno == 0)
-//         {
-//             msg("EOF");
-//         }
-//         else
-//         {
-//             msg("read() error");
-//         }
-//         return err;
-//     }
-
-//     uint32_t len = 0;
-//     memcpy(&len, rbuf, 4);
-//     if (len > k_max_msg)
-//     {
-//         msg("too long");
-//         return -1;
-//     }
-
-//     // reply body
-//     err = read_full(fd, rbuf + 4, len);
-//     if (err)
-//     {
-//         msg("read() error");
-//         return err;
-//     }
-
-//     // do something
-//     rbuf[4 + len] = '\0';
-//     std::cout << "server says: " << rbuf + 4 << std::endl;
-
-//     return 0;
-// }
-
-static int32_t on_response(const uint8_t *data, size_t size)
+static void bench_watch(BenchThread *t, BenchConn *c, bool want_write)
 {
-    if (size < 1)
+    if (want_write == c->want_write)
     {
-        msg("bad response");
-        return -1;
+        return;
     }
-    switch (data[0])
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want_write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev))
     {
+        die("epoll_ctl()");
+    }
+    c->want_write = want_write;
+}
 
-    case SER_NIL:
-        std::cout << "(nil)" << std::endl;
-        return 1;
-
-    case SER_ERR:
-        if (size < 1 + 8)
+static void bench_flush(BenchThread *t, BenchConn *c)
+{
+    while (c->wbuf_sent < c->wbuf.size())
+    {
+        ssize_t rv = send(c->fd, &c->wbuf[c->wbuf_sent], c->wbuf.size() - c->wbuf_sent, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
         {
-            msg("bad response");
-            return -1;
+            continue;
         }
-        else
+        if (rv < 0 && errno == EAGAIN)
         {
-            int32_t code = 0;
-            uint32_t len = 0;
-            memcpy(&code, &data[1], 4);
-            memcpy(&len, &data[1 + 4], 4);
-
-            if (size < 1 + 8 + len)
-            {
-                msg("bad response");
-                return -1;
-            }
-            std::cout << "(err) ";
-            std::cout.write((char *)&data[1 + 8], len);
-            std::cout << std::endl;
-            return 1 + 8 + len;
+            return bench_watch(t, c, true);
         }
+        if (rv < 0)
+        {
+            die("send()");
+        }
+        c->wbuf_sent += (size_t)rv;
+    }
+    c->wbuf.clear();
+    c->wbuf_sent = 0;
+    bench_watch(t, c, false);
+}
 
-    case SER_STR:
-        if (size < 1 + 4)
+// Parses the complete responses in rbuf and queues a request for each
+static void bench_responses(BenchThread *t, BenchConn *c)
+{
+    size_t pos = 0;
+    while (c->rbuf.size() - pos >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, &c->rbuf[pos], 4);
+        if (len < 1 || len > k_max_msg)
         {
-            msg("bad response");
-            return -1;
+            errno = 0;
+            die("bad response");
         }
-        else
+        if (c->rbuf.size() - pos < 4 + (size_t)len)
         {
-            uint32_t len = 0;
-            memcpy(&len, &data[1], 4);
+            break;
+        }
+        uint8_t type = (uint8_t)c->rbuf[pos + 4];
+        pos += 4 + len;
+
+        assert(!c->sent.empty());
+        BenchReq req = c->sent.front();
+        c->sent.pop_front();
+        t->res->latency.record(tsc_now() - req.start);
+        t->res->done++;
+        t->res->errors += type == SER_ERR;
+        if (req.op == BENCH_GET)
+        {
+            t->res->hits += type == SER_STR;
+            t->res->misses += type == SER_NIL;
+        }
+        if (t->issued < t->quota)
+        {
+            bench_queue(t, c);
+        }
+    }
+    c->rbuf.erase(0, pos);
+}
 
-            if (size < 1 + 4 + len)
-            {
-                msg("bad response");
-                return -1;
-            }
-            std::cout << "(str) ";
-            std::cout.write((char *)&data[1 + 4], len);
-            std::cout << std::endl;
-            return 1 + 4 + len;
+static void bench_read(BenchThread *t, BenchConn *c)
+{
+    char buf[64 << 10];
+    while (true)
+    {
+        ssize_t rv = read(c->fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (rv <= 0)
+        {
+            die("read()");
         }
+        c->rbuf.append(buf, (size_t)rv);
+    }
+    bench_responses(t, c);
+    bench_flush(t, c);
+}
 
-    case SER_INT:
-        if (size < 1 + 8)
+static void bench_thread(BenchThread *t)
+{
+    t->epfd = epoll_create1(0);
+    if (t->epfd < 0)
+    {
+        die("epoll_create1()");
+    }
+    for (BenchConn &c : t->conns)
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c.fd, &ev))
         {
-            msg("bad response");
-            return -1;
+            die("epoll_ctl()");
         }
-        else
+        for (size_t i = 0; i < t->conf->pipeline && t->issued < t->quota; i++)
         {
-            int64_t val = 0;
-            memcpy(&val, &data[1], 8);
-            std::cout << "(int) " << val << std::endl;
-            return 1 + 8;
+            bench_queue(t, &c);
         }
+        bench_flush(t, &c);
+    }
 
-    case SER_ARR:
-        if (size < 1 + 4)
+    std::vector<struct epoll_event> events(t->conns.size());
+    while (t->res->done < t->quota)
+    {
+        int rv = epoll_wait(t->epfd, events.data(), (int)events.size(), -1);
+        if (rv < 0 && errno == EINTR)
         {
-            msg("bad response");
-            return -1;
+            continue;
         }
-        else
+        if (rv < 0)
         {
-            uint32_t len = 0;
-            memcpy(&len, &data[1], 4);
-            std::cout << "(arr) len=" << len << std::endl;
-            size_t arr_bytes = 1 + 4;
-            for (u_int32_t i = 0; i < len; i++)
+            die("epoll_wait()");
+        }
+        for (int i = 0; i < rv; i++)
+        {
+            BenchConn *c = (BenchConn *)events[i].data.ptr;
+            if (events[i].events & EPOLLOUT)
+            {
+                bench_flush(t, c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
             {
-                int32_t rv = on_response(&data[arr_bytes], size - arr_bytes);
-                if (rv < 0)
-                {
-                    return rv;
-                }
-                arr_bytes += (size_t)rv;
+                bench_read(t, c);
             }
-            std::cout << "(arr) end" << std::endl;
-            return (int32_t)arr_bytes;
         }
+    }
+    for (BenchConn &c : t->conns)
+    {
+        close(c.fd);
+    }
+    close(t->epfd);
+}
 
-    default:
-        msg("bad response");
-        return -1;
+static int bench_connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
     }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+    if (connect(fd, (const sockaddr *)&addr, sizeof(addr)))
+    {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fd_set_nb(fd);
+    return fd;
 }
 
-static int32_t read_res(int fd, std::vector<std::string> &cmd)
+static void bench_usage()
 {
-    char rbuf[4 + k_max_msg + 1];
-    errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
-    if (err)
+    std::cerr << "usage: client --bench [--conns N] [--threads N] [--requests N] [--pipeline N]"
+              << " [--keys N] [--value-size N] [--mix GET:SET:DEL] [--dist uniform|zipf]"
+              << " [--theta T] [--json]" << std::endl;
+    exit(1);
+}
+
+static BenchConf bench_args(int argc, char **argv)
+{
+    BenchConf conf;
+    for (int i = 2; i < argc; i++)
     {
-        if (errno == 0)
+        std::string arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg == "--json")
+        {
+            conf.json = true;
+            continue;
+        }
+        if (!val)
+        {
+            bench_usage();
+        }
+        i++;
+        if (arg == "--conns")
+        {
+            conf.conns = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--threads")
+        {
+            conf.threads = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--requests")
+        {
+            conf.requests = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--pipeline")
         {
-            msg("EOF");
+            conf.pipeline = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--keys")
+        {
+            conf.keys = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--value-size")
+        {
+            conf.value_size = strtoul(val, NULL, 10);
+        }
+        else if (arg == "--mix")
+        {
+            if (sscanf(val, "%u:%u:%u", &conf.mix[0], &conf.mix[1], &conf.mix[2]) != 3)
+            {
+                bench_usage();
+            }
+        }
+        else if (arg == "--dist" && (std::string(val) == "uniform" || std::string(val) == "zipf"))
+        {
+            conf.zipf = std::string(val) == "zipf";
+        }
+        else if (arg == "--theta")
+        {
+            conf.theta = strtod(val, NULL);
         }
         else
         {
-            msg("read() error");
+            bench_usage();
         }
-        return err;
     }
-
-    uint32_t len = 0;
-    memcpy(&len, rbuf, 4); // assume little endian
-    if (len > k_max_msg)
+    if (!conf.conns || !conf.threads || !conf.pipeline || !conf.keys
+        || conf.mix[0] + conf.mix[1] + conf.mix[2] == 0)
     {
-        msg("too long");
-        return -1;
+        bench_usage();
     }
+    conf.threads = std::min(conf.threads, conf.conns);
+    return conf;
+}
 
-    // reply body
-    err = read_full(fd, &rbuf[4], len);
-    if (err)
+static int bench_main(int argc, char **argv)
+{
+    BenchConf conf = bench_args(argc, argv);
+    tsc_init();
+    Zipf *zipf = conf.zipf ? new Zipf(conf.keys, conf.theta) : NULL;
+
+    std::vector<BenchThread> threads(conf.threads);
+    std::vector<BenchResult> results(conf.threads);
+    for (size_t i = 0; i < conf.threads; i++)
     {
-        msg("read() error");
-        return err;
+        BenchThread &t = threads[i];
+        t.conf = &conf;
+        t.zipf = zipf;
+        t.value.assign(conf.value_size, 'v');
+        t.rng = 88172645463325252ull + i * 0x9e3779b97f4a7c15ull;
+        t.quota = conf.requests / conf.threads + (i < conf.requests % conf.threads);
+        t.res = &results[i];
+        // connections are spread as evenly as the requests
+        size_t nconn = conf.conns / conf.threads + (i < conf.conns % conf.threads);
+        t.conns.resize(nconn);
+        for (BenchConn &c : t.conns)
+        {
+            c.fd = bench_connect();
+        }
     }
 
-    // print the result
-    // uint32_t rescode = 0;
-    // if (len < 4)
-    // {
-    //     msg("bad response");
-    //     return -1;
-    // }
-    // memcpy(&rescode, &rbuf[4], 4);
-    // // std::cout << ("server says: [%u] %.*s\n", rescode, len - 4, &rbuf[8]);
-    // std::cout << "Server says: [" << rescode << "] ";
-    // fprintf(stdout, "%.*s", len - 4, &rbuf[8]);
-    // std::cout << std::endl;
-    // return 0;
+    uint64_t start = tsc_now();
+    std::vector<std::thread> running;
+    for (BenchThread &t : threads)
+    {
+        running.emplace_back(bench_thread, &t);
+    }
+    for (std::thread &th : running)
+    {
+        th.join();
+    }
+    double per_ns = tsc_per_ns();
+    double secs = (double)(tsc_now() - start) / per_ns / 1e9;
 
-    // print the result
-    int32_t rv = on_response((uint8_t *)&rbuf[4], len);
-    if (rv > 0 && (uint32_t)rv != len)
+    BenchResult total;
+    for (BenchResult &r : results)
+    {
+        total.latency.merge(r.latency);
+        total.done += r.done;
+        total.errors += r.errors;
+        total.hits += r.hits;
+        total.misses += r.misses;
+    }
+    auto usec = [&](uint64_t ticks) { return (double)ticks / per_ns / 1000; };
+    double mean = total.done ? usec(total.latency.sum) / (double)total.done : 0;
+    double p50 = usec(total.latency.percentile(0.5));
+    double p99 = usec(total.latency.percentile(0.99));
+    double p999 = usec(total.latency.percentile(0.999));
+    double max = usec(total.latency.max);
+    double rps = secs > 0 ? (double)total.done / secs : 0;
+
+    char out[2048];
+    if (conf.json)
     {
-        msg("bad response");
-        rv = -1;
+        snprintf(out, sizeof(out),
+                 "{\"requests\": %lu, \"conns\": %zu, \"threads\": %zu, \"pipeline\": %zu, "
+                 "\"keys\": %zu, \"value_size\": %zu, \"mix\": {\"get\": %u, \"set\": %u, \"del\": %u}, "
+                 "\"dist\": \"%s\", \"theta\": %g, \"seconds\": %.3f, \"requests_per_sec\": %.0f, "
+                 "\"latency_usec\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, "
+                 "\"errors\": %lu, \"get_hits\": %lu, \"get_misses\": %lu}",
+                 (unsigned long)total.done, conf.conns, conf.threads, conf.pipeline, conf.keys,
+                 conf.value_size, conf.mix[0], conf.mix[1], conf.mix[2], conf.zipf ? "zipf" : "uniform",
+                 conf.zipf ? conf.theta : 0, secs, rps, mean, p50, p99, p999, max,
+                 (unsigned long)total.errors, (unsigned long)total.hits, (unsigned long)total.misses);
     }
-    return rv;
+    else
+    {
+        snprintf(out, sizeof(out),
+                 "%lu requests, %zu conns, %zu threads, pipeline %zu, %zu %s keys, %zu byte values,"
+                 " get:set:del %u:%u:%u\n"
+                 "%.3f s, %.0f requests/s, %lu errors, %lu get hits, %lu get misses\n"
+                 "latency usec: mean %.1f, p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f",
+                 (unsigned long)total.done, conf.conns, conf.threads, conf.pipeline, conf.keys,
+                 conf.zipf ? "zipf" : "uniform", conf.value_size, conf.mix[0], conf.mix[1], conf.mix[2],
+                 secs, rps, (unsigned long)total.errors, (unsigned long)total.hits,
+                 (unsigned long)total.misses, mean, p50, p99, p999, max);
+    }
+    std::cout << out << std::endl;
+    delete zipf;
+    return 0;
 }
 
 int main(int argc, char **argv)
 {
-    int fd;
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
-    {
-        die("socket()");
-    }
-
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
-
-    int rv = connect(fd, (const sockaddr *)&addr, sizeof(addr));
-
-    if (rv)
+    if (argc > 1 && std::string(argv[1]) == "--bench")
     {
-        die("connect()");
+        return bench_main(argc, argv);
     }
 
-    std::vector<std::string> cmd;
-    for (int i = 1; i < argc; i++)
+    // client [--pipeline N] cmd args...
+    // client --bench [options], see bench_usage()
+    size_t depth = 1;
+    int argi = 1;
+    if (argc > 2 && std::string(argv[1]) == "--pipeline")
     {
-        cmd.push_back(argv[i]);
+        depth = std::max<size_t>(strtoul(argv[2], NULL, 10), 1);
+        argi = 3;
     }
-    int32_t err = send_req(fd, cmd);
-    if (err)
+    std::vector<std::string_view> cmd(argv + argi, argv + argc);
+
+    // the calls are all sent before any reply is awaited. Those queued
+    // while the IO thread is busy go out together, so a pipeline of N
+    // usually takes a few writes, but this is not guaranteed to be one.
+    KVClient client("127.0.0.1", 1234);
+    std::vector<std::future<KVReply>> replies;
+    for (size_t i = 0; i < depth; i++)
     {
-        goto L_DONE;
+        replies.push_back(client.call(cmd.data(), cmd.size()));
     }
-    err = read_res(fd, cmd);
-    if (err)
+    for (std::future<KVReply> &fut : replies)
     {
-        goto L_DONE;
+        KVReply reply = fut.get();
+        if (reply.value.type == SER_ERR && reply.value.code == k_kv_err_conn)
+        {
+            msg(std::string(reply.value.str).c_str());
+            break;
+        }
+        print_value(reply.value);
     }
-
-L_DONE:
-    close(fd);
     return 0;
 }
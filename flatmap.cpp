@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "flatmap.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const int8_t k_ctrl_empty = -128;  // 0x80
+const int8_t k_ctrl_deleted = -2;  // 0xFE
+const size_t k_group = 16;
+
+const size_t k_flat_resizing_work = 128;
+
+static size_t group_of(u_int64_t hcode, size_t mask)
+{
+    return (hcode >> 7) & mask;
+}
+
+static int8_t fingerprint(u_int64_t hcode)
+{
+    return (int8_t)(hcode & 0x7F);
+}
+
+// Bit i is set when ctrl[i] equals the byte
+static uint32_t match_byte(const int8_t *ctrl, int8_t b)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b)));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        bits |= (uint32_t)(ctrl[i] == b) << i;
+    }
+    return bits;
+#endif
+}
+
+// Bit i is set when ctrl[i] is empty or deleted (the top bit is set)
+static uint32_t match_free(const int8_t *ctrl)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        bits |= (uint32_t)(ctrl[i] < 0) << i;
+    }
+    return bits;
+#endif
+}
+
+FlatTab::FlatTab(size_t ngroups)
+{
+    assert(ngroups > 0 && ((ngroups - 1) & ngroups) == 0);
+    size_t cap = ngroups * k_group;
+    ctrl = (int8_t *)aligned_alloc(k_group, cap);
+    slots = (HNode **)malloc(cap * sizeof(HNode *));
+    if (!ctrl || !slots)
+    {
+        abort();
+    }
+    memset(ctrl, k_ctrl_empty, cap);
+    mask = ngroups - 1;
+    size = used = 0;
+}
+
+void FlatTab::insert(HNode *node)
+{
+    // The caller guarantees the key is not present and there is room
+    size_t g = group_of(node->hcode, mask);
+    for (size_t step = 1;; step++)
+    {
+        int8_t *group = &ctrl[g * k_group];
+        uint32_t bits = match_free(group);
+        if (bits)
+        {
+            size_t i = g * k_group + __builtin_ctz(bits);
+            if (ctrl[i] == k_ctrl_empty)
+            {
+                used++;
+            }
+            ctrl[i] = fingerprint(node->hcode);
+            slots[i] = node;
+            size++;
+            return;
+        }
+        // Triangular probing visits every group when the count is a power of 2
+        g = (g + step) & mask;
+    }
+}
+
+HNode **FlatTab::f_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    if (!ctrl)
+        return NULL;
+    int8_t fp = fingerprint(key->hcode);
+    size_t g = group_of(key->hcode, mask);
+    for (size_t step = 1; step <= mask + 1; step++)
+    {
+        int8_t *group = &ctrl[g * k_group];
+        for (uint32_t bits = match_byte(group, fp); bits; bits &= bits - 1)
+        {
+            size_t i = g * k_group + __builtin_ctz(bits);
+            if (slots[i]->hcode == key->hcode && cmp(slots[i], key))
+            {
+                return &slots[i];
+            }
+        }
+        if (match_byte(group, k_ctrl_empty))
+        {
+            // An empty slot ends the probe sequence
+            return NULL;
+        }
+        g = (g + step) & mask;
+    }
+    return NULL;
+}
+
+HNode *FlatTab::f_detach(HNode **from)
+{
+    size_t i = from - slots;
+    HNode *node = *from;
+    // If the group still has an empty slot, no probe sequence continued
+    // past it, so the slot can go back to empty instead of a tombstone
+    int8_t *group = &ctrl[i & ~(k_group - 1)];
+    if (match_byte(group, k_ctrl_empty))
+    {
+        ctrl[i] = k_ctrl_empty;
+        used--;
+    }
+    else
+    {
+        ctrl[i] = k_ctrl_deleted;
+    }
+    size--;
+    return node;
+}
+
+void FlatTab::f_scan(void (*f)(HNode *, void *), void *arg)
+{
+    if (size == 0)
+        return;
+    for (size_t i = 0; i < capacity(); i++)
+    {
+        if (ctrl[i] >= 0)
+        {
+            f(slots[i], arg);
+        }
+    }
+}
+
+void FlatTab::f_free()
+{
+    free(ctrl);
+    free(slots);
+    *this = FlatTab();
+}
+
+void FlatMap::fm_help_resizing()
+{
+    if (t2.ctrl == NULL)
+    {
+        return;
+    }
+    // Scanning free slots counts as work too, so each call is bounded
+    size_t nwork = 0;
+    size_t cap = t2.capacity();
+    while (nwork < k_flat_resizing_work * 4 && t2.size > 0 && resizing_pos < cap)
+    {
+        size_t i = resizing_pos++;
+        nwork++;
+        if (t2.ctrl[i] >= 0)
+        {
+            HNode *node = t2.slots[i];
+            t2.ctrl[i] = k_ctrl_deleted;
+            t2.size--;
+            t1.insert(node);
+        }
+    }
+
+    if (t2.size == 0)
+    {
+        // Done with resizing
+        t2.f_free();
+    }
+}
+
+void FlatMap::fm_start_resizing()
+{
+    assert(t2.ctrl == NULL);
+
+    // Grow when mostly live, otherwise rebuild at the same size to drop tombstones
+    size_t ngroups = t1.mask + 1;
+    if (t1.size * 2 >= t1.capacity())
+    {
+        ngroups *= 2;
+    }
+    t2 = t1;
+    t1 = FlatTab(ngroups);
+    resizing_pos = 0;
+}
+
+void FlatMap::fm_insert(HNode *node)
+{
+    if (!t1.ctrl)
+    {
+        t1 = FlatTab(1);
+    }
+
+    // Keep the load, tombstones included, at 7/8 or below
+    if ((t1.used + 1) * 8 > t1.capacity() * 7)
+    {
+        while (t2.ctrl)
+        {
+            // The previous resize must finish before starting another
+            fm_help_resizing();
+        }
+        fm_start_resizing();
+    }
+    t1.insert(node);
+    fm_help_resizing();
+}
+
+HNode *FlatMap::fm_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    fm_help_resizing();
+    HNode **from = t1.f_lookup(key, cmp);
+    if (!from)
+    {
+        from = t2.f_lookup(key, cmp);
+    }
+    return from ? *from : NULL;
+}
+
+HNode *FlatMap::fm_pop(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    fm_help_resizing();
+    HNode **from = t1.f_lookup(key, cmp);
+    if (from)
+    {
+        return t1.f_detach(from);
+    }
+    from = t2.f_lookup(key, cmp);
+    if (from)
+    {
+        return t2.f_detach(from);
+    }
+    return NULL;
+}
+
+size_t FlatMap::fm_size()
+{
+    return t1.size + t2.size;
+}
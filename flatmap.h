@@ -0,0 +1,54 @@
+#include <string.h>
+#include <iostream>
+#include "hashtable.h"
+
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+// Open addressing table of HNode pointers, probed a group of 16 slots at
+// a time. Each slot has a control byte holding 7 bits of the hash, so most
+// mismatches are rejected without touching the node.
+class FlatTab
+{
+public:
+    int8_t *ctrl;
+    HNode **slots;
+    size_t mask;     // number of groups - 1
+    size_t size;     // live nodes
+    size_t used;     // live nodes + tombstones
+
+    FlatTab()
+    {
+        ctrl = NULL;
+        slots = NULL;
+        mask = size = used = 0;
+    }
+    FlatTab(size_t ngroups);
+
+    size_t capacity() { return ctrl ? (mask + 1) * 16 : 0; }
+    void insert(HNode *node);
+    HNode **f_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *));
+    HNode *f_detach(HNode **from);
+    void f_scan(void (*f)(HNode *, void *), void *arg);
+    void f_free();
+};
+
+// Same interface as HMap, including the incremental rehash
+class FlatMap
+{
+public:
+    FlatTab t1;
+    FlatTab t2;
+    size_t resizing_pos = 0;
+
+    HNode *fm_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *));
+    void fm_insert(HNode *node);
+    HNode *fm_pop(const HKey *key, bool (*cmp)(HNode *, const HKey *));
+    size_t fm_size();
+
+private:
+    void fm_help_resizing();
+    void fm_start_resizing();
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "hash.h"
+
+const uint64_t k_p0 = 0xa0761d6478bd642fULL;
+const uint64_t k_p1 = 0xe7037ed1a0b428dbULL;
+const uint64_t k_p2 = 0x8ebc6af09c88c6e3ULL;
+const uint64_t k_p3 = 0x589965cc75374cc3ULL;
+
+static uint64_t g_seed = k_p0;
+
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    // Fold the 128 bit product
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+void hash_seed_init()
+{
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+    {
+        struct timespec tv = {0, 0};
+        clock_gettime(CLOCK_MONOTONIC, &tv);
+        seed = (uint64_t)tv.tv_nsec ^ ((uint64_t)getpid() << 32);
+    }
+    g_seed = seed;
+}
+
+uint64_t hash_seed()
+{
+    return g_seed;
+}
+
+uint64_t str_hash_seed(const uint8_t *p, size_t len, uint64_t seed)
+{
+    seed ^= mix(seed ^ k_p0, k_p1);
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // Two overlapping reads cover 4..16 bytes without a loop
+            size_t off = (len >> 3) << 2;
+            a = (read4(p) << 32) | read4(p + off);
+            b = (read4(p + len - 4) << 32) | read4(p + len - 4 - off);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            // Three independent lanes keep the multipliers busy
+            uint64_t s1 = seed;
+            uint64_t s2 = seed;
+            do
+            {
+                seed = mix(read8(p) ^ k_p1, read8(p + 8) ^ seed);
+                s1 = mix(read8(p + 16) ^ k_p2, read8(p + 24) ^ s1);
+                s2 = mix(read8(p + 32) ^ k_p3, read8(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16)
+        {
+            seed = mix(read8(p) ^ k_p1, read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+
+    a ^= k_p1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return mix(a ^ k_p0 ^ len, b ^ k_p1);
+}
+
+uint64_t str_hash(const uint8_t *data, size_t len)
+{
+    return str_hash_seed(data, len, g_seed);
+}
@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HASH_H
+#define HASH_H
+
+// Seeds str_hash() from the OS. Call once at startup before any keys are
+// hashed, otherwise a fixed seed is used.
+void hash_seed_init();
+uint64_t hash_seed();
+
+// wyhash-style hash, reads 8 bytes per step
+uint64_t str_hash_seed(const uint8_t *data, size_t len, uint64_t seed);
+uint64_t str_hash(const uint8_t *data, size_t len);
+
+#endif
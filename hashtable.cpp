@@ -1,14 +1,15 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
 #include "hashtable.h"
 
 HTab::HTab(size_t n)
 {
     assert(n > 0 && ((n - 1) & n) == 0);
-    tab = new HNode *[n];
-    for (size_t i = 0; i < n; i++)
-    {
-        tab[i] = NULL;
-    }
+    // freed with free(), and large zeroed tables come straight from mmap()
+    tab = (HNode **)calloc(n, sizeof(HNode *));
+    assert(tab);
     mask = n - 1;
     size = 0;
     slots = n;
@@ -45,6 +46,25 @@ HNode **HTab::h_lookup(HNode *key, bool (*cmp)(HNode *, HNode *))
     return NULL;
 }
 
+HNode **HTab::h_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    if (!tab)
+        return NULL;
+    size_t pos = key->hcode & mask;
+
+    HNode **from = &tab[pos];
+    while (*from)
+    {
+        // The hash rejects most mismatches before the key is compared
+        if ((*from)->hcode == key->hcode && cmp(*from, key))
+        {
+            return from;
+        }
+        from = &((*from)->next);
+    }
+    return NULL;
+}
+
 HNode *HTab::h_detach(HNode **from)
 {
     // This replaces the next node address at the original node address
@@ -55,6 +75,29 @@ HNode *HTab::h_detach(HNode **from)
     return node;
 }
 
+// Picks a node with the random number r, NULL when empty. Starts at a
+// random slot and walks a few links into its chain, so it is cheap but
+// only roughly uniform, which is enough for eviction sampling.
+HNode *HTab::h_sample(uint64_t r)
+{
+    if (size == 0)
+        return NULL;
+    for (size_t i = 0; i <= mask; i++)
+    {
+        HNode *node = tab[(r + i) & mask];
+        if (!node)
+        {
+            continue;
+        }
+        for (size_t steps = (r >> 48) & 7; steps > 0 && node->next; steps--)
+        {
+            node = node->next;
+        }
+        return node;
+    }
+    return NULL;
+}
+
 void HTab::h_scan(void (*f)(HNode *, void *), void *arg)
 {
     if (size == 0)
@@ -72,6 +115,8 @@ void HTab::h_scan(void (*f)(HNode *, void *), void *arg)
 
 const size_t k_resizing_work = 128;
 const size_t k_max_load_factor = 8;
+// Lookups of a batch whose memory accesses are interleaved
+const size_t k_lookup_group = 16;
 
 void HMap::hm_help_resizing()
 {
@@ -142,6 +187,82 @@ HNode *HMap::hm_lookup(HNode *key, bool (*cmp)(HNode *, HNode *))
     return from ? *from : NULL;
 }
 
+HNode *HMap::hm_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    hm_help_resizing();
+    HNode **from = ht1.h_lookup(key, cmp);
+    if (!from)
+    {
+        from = ht2.h_lookup(key, cmp);
+    }
+    return from ? *from : NULL;
+}
+
+// Looks up keys[0, n) like hm_lookup and stores each result in out[i].
+// A lookup is a chain of dependent loads, the slot and then each node of
+// the chain, and on a large table every one of them misses the cache.
+// Here the lookups of a group advance in stages: the slots of all of
+// them are prefetched, then their first nodes, then every unfinished
+// lookup compares one node and prefetches the next per round. The group
+// waits for its misses together instead of one after another.
+void HMap::hm_lookup_batch(const HKey *keys, size_t n, bool (*cmp)(HNode *, const HKey *),
+                           HNode **out)
+{
+    hm_help_resizing();
+    HNode *node[k_lookup_group];
+    HTab *table[k_lookup_group]; // being probed, NULL once done
+    for (size_t base = 0; base < n; base += k_lookup_group)
+    {
+        const HKey *key = &keys[base];
+        size_t m = std::min(n - base, k_lookup_group);
+        for (size_t i = 0; i < m; i++)
+        {
+            if (ht1.tab)
+            {
+                __builtin_prefetch(&ht1.tab[key[i].hcode & ht1.mask]);
+            }
+            if (ht2.tab)
+            {
+                __builtin_prefetch(&ht2.tab[key[i].hcode & ht2.mask]);
+            }
+        }
+        for (size_t i = 0; i < m; i++)
+        {
+            table[i] = &ht1;
+            node[i] = ht1.tab ? ht1.tab[key[i].hcode & ht1.mask] : NULL;
+            __builtin_prefetch(node[i]);
+        }
+        for (size_t active = m; active > 0;)
+        {
+            for (size_t i = 0; i < m; i++)
+            {
+                HNode *cur = node[i];
+                if (!table[i])
+                {
+                    continue;
+                }
+                if (!cur && table[i] == &ht1 && ht2.tab)
+                {
+                    // not in the new table, try the one being emptied
+                    table[i] = &ht2;
+                    node[i] = ht2.tab[key[i].hcode & ht2.mask];
+                    __builtin_prefetch(node[i]);
+                    continue;
+                }
+                if (!cur || (cur->hcode == key[i].hcode && cmp(cur, &key[i])))
+                {
+                    out[base + i] = cur;
+                    table[i] = NULL;
+                    active--;
+                    continue;
+                }
+                node[i] = cur->next;
+                __builtin_prefetch(node[i]);
+            }
+        }
+    }
+}
+
 HNode *HMap::hm_pop(HNode *key, bool (*cmp)(HNode *, HNode *))
 {
     hm_help_resizing();
@@ -158,6 +279,88 @@ HNode *HMap::hm_pop(HNode *key, bool (*cmp)(HNode *, HNode *))
     return NULL;
 }
 
+HNode *HMap::hm_pop(const HKey *key, bool (*cmp)(HNode *, const HKey *))
+{
+    hm_help_resizing();
+    HNode **from = ht1.h_lookup(key, cmp);
+    if (from)
+    {
+        return ht1.h_detach(from);
+    }
+    from = ht2.h_lookup(key, cmp);
+    if (from)
+    {
+        return ht2.h_detach(from);
+    }
+    return NULL;
+}
+
+HNode *HMap::hm_sample(uint64_t r)
+{
+    // pick a table in proportion to the number of nodes it holds
+    if (ht2.size > 0 && (r >> 32) % hm_size() < ht2.size)
+    {
+        return ht2.h_sample(r);
+    }
+    return ht1.h_sample(r);
+}
+
+static size_t rev_bits(size_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// Increments the slot bits of the cursor from the high bit down
+static size_t rev_next(size_t v, size_t mask)
+{
+    v |= ~mask;
+    return rev_bits(rev_bits(v) + 1);
+}
+
+static void scan_slot(HTab *t, size_t pos, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = t->tab[pos & t->mask]; node; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+// Visits the nodes of one cursor position and returns the next cursor,
+// 0 when the scan is done. The cursor counts in reverse binary, so the
+// slots already visited stay visited when the table doubles: every node
+// present for the whole scan is reported at least once, some may be
+// reported twice. During resizing the matching slots of both tables are
+// visited, the larger table has 2 slots for each slot of the smaller.
+size_t HMap::hm_scan(size_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    if (!ht1.tab)
+    {
+        return 0;
+    }
+    if (!ht2.tab)
+    {
+        scan_slot(&ht1, cursor, f, arg);
+        return rev_next(cursor, ht1.mask);
+    }
+
+    HTab *small = &ht1;
+    HTab *large = &ht2;
+    if (small->mask > large->mask)
+    {
+        std::swap(small, large);
+    }
+    scan_slot(small, cursor, f, arg);
+    do
+    {
+        scan_slot(large, cursor, f, arg);
+        cursor = rev_next(cursor, large->mask);
+    } while (cursor & (small->mask ^ large->mask));
+    return cursor;
+}
+
 size_t HMap::hm_size()
 {
     return ht1.size + ht2.size;
@@ -17,6 +17,15 @@ public:
     }
 };
 
+// A lookup key given by its bytes and hash, so that callers can search
+// without constructing a node for it
+struct HKey
+{
+    const uint8_t *data;
+    size_t len;
+    u_int64_t hcode;
+};
+
 class HTab
 {
 public:
@@ -34,7 +43,9 @@ public:
 
     void insert(HNode *node);
     HNode **h_lookup(HNode *key, bool (*cmp)(HNode *, HNode *));
+    HNode **h_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *));
     HNode *h_detach(HNode **from);
+    HNode *h_sample(uint64_t r);
     void h_scan(void (*f)(HNode *, void *), void *arg);
 };
 
@@ -46,8 +57,14 @@ public:
     size_t resizing_pos = 0;
 
     HNode *hm_lookup(HNode *key, bool (*cmp)(HNode *, HNode *));
+    HNode *hm_lookup(const HKey *key, bool (*cmp)(HNode *, const HKey *));
+    void hm_lookup_batch(const HKey *keys, size_t n, bool (*cmp)(HNode *, const HKey *),
+                         HNode **out);
     void hm_insert(HNode *node);
     HNode *hm_pop(HNode *key, bool (*cmp)(HNode *, HNode *));
+    HNode *hm_pop(const HKey *key, bool (*cmp)(HNode *, const HKey *));
+    HNode *hm_sample(uint64_t r);
+    size_t hm_scan(size_t cursor, void (*f)(HNode *, void *), void *arg);
     size_t hm_size();
 
 private:
@@ -0,0 +1,19 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HEAP_H
+#define HEAP_H
+
+// Item of an indexed min-heap. `ref` points at the owner's copy of the
+// item's position, which is kept current as items move, so the owner can
+// update or remove its item in O(log n).
+struct HeapItem
+{
+    uint64_t val = 0;
+    size_t *ref = NULL;
+};
+
+// restore the heap property after a[pos] changed
+void heap_update(HeapItem *a, size_t pos, size_t len);
+
+#endif
@@ -0,0 +1,528 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include "kvclient.h"
+
+// Same cap as the server's, a longer response means a broken stream
+const size_t k_kv_max_msg = 32 << 20;
+const size_t k_kv_read_chunk = 64 << 10;
+
+static int64_t kv_decode_depth(const uint8_t *data, size_t size, KVValue *out, uint32_t depth)
+{
+    if (size < 1 || depth > k_kv_max_depth)
+    {
+        return -1;
+    }
+    out->type = data[0];
+    out->arr.clear();
+    size_t used = 0;
+    uint32_t len = 0;
+    switch (data[0])
+    {
+    case SER_NIL:
+        used = 1;
+        break;
+    case SER_ERR:
+        if (size < 1 + 8)
+        {
+            return -1;
+        }
+        memcpy(&out->code, &data[1], 4);
+        memcpy(&len, &data[1 + 4], 4);
+        if (size - (1 + 8) < len)
+        {
+            return -1;
+        }
+        out->str = std::string_view((const char *)&data[1 + 8], len);
+        used = 1 + 8 + len;
+        break;
+    case SER_STR:
+        if (size < 1 + 4)
+        {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        if (size - (1 + 4) < len)
+        {
+            return -1;
+        }
+        out->str = std::string_view((const char *)&data[1 + 4], len);
+        used = 1 + 4 + len;
+        break;
+    case SER_INT:
+    case SER_DBL:
+        if (size < 1 + 8)
+        {
+            return -1;
+        }
+        if (data[0] == SER_INT)
+        {
+            memcpy(&out->i, &data[1], 8);
+        }
+        else
+        {
+            memcpy(&out->d, &data[1], 8);
+        }
+        used = 1 + 8;
+        break;
+    case SER_ARR:
+        if (size < 1 + 4)
+        {
+            return -1;
+        }
+        memcpy(&len, &data[1], 4);
+        used = 1 + 4;
+        // every element takes at least a byte, so a bogus length cannot
+        // make this allocate more than the input
+        out->arr.reserve(std::min<size_t>(len, size - used));
+        for (uint32_t i = 0; i < len; i++)
+        {
+            out->arr.emplace_back();
+            int64_t rv = kv_decode_depth(&data[used], size - used, &out->arr.back(), depth + 1);
+            if (rv < 0)
+            {
+                return -1;
+            }
+            used += (size_t)rv;
+        }
+        break;
+    default:
+        return -1;
+    }
+    out->raw = std::string_view((const char *)data, used);
+    return (int64_t)used;
+}
+
+int64_t kv_decode(const uint8_t *data, size_t size, KVValue *out)
+{
+    return kv_decode_depth(data, size, out, 0);
+}
+
+void kv_encode(std::string &out, const std::string_view *args, size_t n)
+{
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t nargs = (uint32_t)n;
+    out.append((char *)&nargs, 4);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t p = (uint32_t)args[i].size();
+        out.append((char *)&p, 4);
+        out.append(args[i]);
+    }
+}
+
+void kv_encode(std::string &out, std::initializer_list<std::string_view> args)
+{
+    kv_encode(out, args.begin(), args.size());
+}
+
+KVReply::KVReply(std::string_view bytes)
+    : raw(bytes.begin(), bytes.end())
+{
+    if (kv_decode(raw.data(), raw.size(), &value) < 0)
+    {
+        value = KVValue();
+    }
+}
+
+KVConn::~KVConn()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+static void fd_set_nb(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    (void)fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+bool KVConn::connect(const char *host, uint16_t port)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    broken = false; // a broken connection starts over
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fail("bad address");
+        return false;
+    }
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        fail(strerror(errno));
+        return false;
+    }
+    attach(s);
+    if (::connect(fd, (const sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS)
+    {
+        fail(strerror(errno));
+        return false;
+    }
+    // requests queued meanwhile go out once the socket is writable
+    return true;
+}
+
+void KVConn::attach(int s)
+{
+    fd = s;
+    broken = false;
+    fd_set_nb(fd);
+    int val = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+void KVConn::send(const std::string_view *args, size_t n, Callback cb)
+{
+    pending.push_back(std::move(cb));
+    if (broken)
+    {
+        return fail(NULL);
+    }
+    kv_encode(wbuf, args, n);
+}
+
+void KVConn::send(std::initializer_list<std::string_view> args, Callback cb)
+{
+    send(args.begin(), args.size(), std::move(cb));
+}
+
+bool KVConn::flush()
+{
+    if (broken)
+    {
+        fail(NULL);
+        return false;
+    }
+    while (wbuf_sent < wbuf.size())
+    {
+        ssize_t rv = ::send(fd, &wbuf[wbuf_sent], wbuf.size() - wbuf_sent, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && (errno == EAGAIN || errno == ENOTCONN))
+        {
+            return true; // still connecting, or the socket is full
+        }
+        if (rv < 0)
+        {
+            fail(strerror(errno));
+            return false;
+        }
+        wbuf_sent += (size_t)rv;
+    }
+    wbuf.clear();
+    wbuf_sent = 0;
+    return true;
+}
+
+bool KVConn::read()
+{
+    if (broken)
+    {
+        fail(NULL);
+        return false;
+    }
+    while (true)
+    {
+        ssize_t rv = ::read(fd, rbuf.reserve(k_kv_read_chunk), k_kv_read_chunk);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (rv <= 0)
+        {
+            fail(rv == 0 ? "connection closed" : strerror(errno));
+            return false;
+        }
+        rbuf.commit((size_t)rv);
+    }
+
+    KVValue val;
+    while (rbuf.size() >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, rbuf.data(), 4);
+        if (len > k_kv_max_msg)
+        {
+            fail("response is too long");
+            return false;
+        }
+        if (rbuf.size() < 4 + (size_t)len)
+        {
+            break;
+        }
+        if (kv_decode(rbuf.data() + 4, len, &val) != (int64_t)len || pending.empty())
+        {
+            fail("bad response");
+            return false;
+        }
+        Callback cb = std::move(pending.front());
+        pending.pop_front();
+        // the value points into rbuf, which is consumed only afterwards
+        cb(val);
+        rbuf.consume(4 + (size_t)len);
+    }
+    if (rbuf.size() == 0)
+    {
+        rbuf.release();
+    }
+    return true;
+}
+
+void KVConn::fail(const char *msg)
+{
+    if (!broken)
+    {
+        broken = true;
+        error = msg ? msg : "connection failed";
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        wbuf.clear();
+        wbuf_sent = 0;
+        rbuf.consume(rbuf.size());
+        rbuf.release();
+    }
+
+    // the same encoding as a server error, so the value has raw bytes
+    std::string enc(1, (char)SER_ERR);
+    uint32_t len = (uint32_t)error.size();
+    enc.append((const char *)&k_kv_err_conn, 4);
+    enc.append((const char *)&len, 4);
+    enc.append(error);
+    KVValue val;
+    kv_decode((const uint8_t *)enc.data(), enc.size(), &val);
+    while (!pending.empty())
+    {
+        Callback cb = std::move(pending.front());
+        pending.pop_front();
+        cb(val);
+    }
+}
+
+KVClient::KVClient(const char *host, uint16_t port, size_t nconns) : host(host), port(port)
+{
+    epfd = epoll_create1(0);
+    wakefd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    std::string error; // why there is no IO thread
+    if (epfd < 0 || wakefd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev))
+    {
+        error = strerror(errno);
+    }
+
+    for (size_t i = 0; i < std::max<size_t>(nconns, 1); i++)
+    {
+        slots.emplace_back(new Slot());
+        Slot *slot = slots.back().get();
+        if (!error.empty())
+        {
+            slot->conn.fail(error.c_str());
+        }
+        else
+        {
+            connect(slot);
+        }
+    }
+    if (error.empty())
+    {
+        io = std::thread(&KVClient::loop, this);
+    }
+}
+
+KVClient::~KVClient()
+{
+    if (io.joinable())
+    {
+        stop = true;
+        uint64_t one = 1;
+        (void)!write(wakefd, &one, sizeof(one));
+        io.join();
+    }
+    if (epfd >= 0)
+    {
+        close(epfd);
+    }
+    if (wakefd >= 0)
+    {
+        close(wakefd);
+    }
+}
+
+void KVClient::send(const std::string_view *args, size_t n, KVConn::Callback cb)
+{
+    Slot *slot = slots[next.fetch_add(1, std::memory_order_relaxed) % slots.size()].get();
+    if (!io.joinable())
+    {
+        // the client could not start, the broken slot answers right away
+        std::lock_guard<std::mutex> lock(slot->mu);
+        return slot->conn.send(args, n, std::move(cb));
+    }
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(slot->mu);
+        // one wakeup per batch, the IO thread takes the whole outbox
+        wake = slot->outbox_cbs.empty();
+        kv_encode(slot->outbox, args, n);
+        slot->outbox_cbs.push_back(std::move(cb));
+    }
+    if (wake)
+    {
+        uint64_t one = 1;
+        (void)!write(wakefd, &one, sizeof(one));
+    }
+}
+
+void KVClient::send(std::initializer_list<std::string_view> args, KVConn::Callback cb)
+{
+    send(args.begin(), args.size(), std::move(cb));
+}
+
+std::future<KVReply> KVClient::call(const std::string_view *args, size_t n)
+{
+    auto promise = std::make_shared<std::promise<KVReply>>();
+    std::future<KVReply> fut = promise->get_future();
+    send(args, n, [promise](const KVValue &val) { promise->set_value(KVReply(val.raw)); });
+    return fut;
+}
+
+std::future<KVReply> KVClient::call(std::initializer_list<std::string_view> args)
+{
+    return call(args.begin(), args.size());
+}
+
+// Starts connecting a slot and watches its socket, false if it failed
+// right away
+bool KVClient::connect(Slot *slot)
+{
+    if (!slot->conn.connect(host.c_str(), port))
+    {
+        return false;
+    }
+    // writable once connected, which sends what was queued meanwhile
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = slot;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, slot->conn.fd, &ev))
+    {
+        slot->conn.fail(strerror(errno));
+        return false;
+    }
+    slot->watched_out = true;
+    return true;
+}
+
+void KVClient::take_outbox(Slot *slot)
+{
+    std::string outbox;
+    std::vector<KVConn::Callback> cbs;
+    {
+        std::lock_guard<std::mutex> lock(slot->mu);
+        outbox.swap(slot->outbox);
+        cbs.swap(slot->outbox_cbs);
+    }
+    if (cbs.empty())
+    {
+        return;
+    }
+    KVConn &conn = slot->conn;
+    if (conn.broken && !stop)
+    {
+        // lost since its last requests, those have been failed already
+        connect(slot);
+    }
+    if (conn.wbuf.empty())
+    {
+        conn.wbuf.swap(outbox);
+    }
+    else
+    {
+        conn.wbuf.append(outbox);
+    }
+    for (KVConn::Callback &cb : cbs)
+    {
+        conn.pending.push_back(std::move(cb));
+    }
+    // one write for everything submitted since the last one
+    conn.flush();
+    watch(slot);
+}
+
+void KVClient::watch(Slot *slot)
+{
+    KVConn &conn = slot->conn;
+    bool want = !conn.broken && conn.want_write();
+    if (conn.broken || want == slot->watched_out)
+    {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = slot;
+    (void)epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+    slot->watched_out = want;
+}
+
+void KVClient::loop()
+{
+    struct epoll_event events[64];
+    while (!stop)
+    {
+        int rv = epoll_wait(epfd, events, 64, -1);
+        for (int i = 0; i < rv; i++)
+        {
+            Slot *slot = (Slot *)events[i].data.ptr;
+            if (!slot)
+            {
+                uint64_t cnt = 0;
+                (void)!read(wakefd, &cnt, sizeof(cnt));
+                for (std::unique_ptr<Slot> &s : slots)
+                {
+                    take_outbox(s.get());
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                slot->conn.flush();
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                slot->conn.read();
+            }
+            watch(slot);
+        }
+    }
+
+    for (std::unique_ptr<Slot> &s : slots)
+    {
+        take_outbox(s.get());
+        s->conn.fail("client closed");
+    }
+}
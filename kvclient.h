@@ -0,0 +1,159 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "buffer.h"
+
+#ifndef KVCLIENT_H
+#define KVCLIENT_H
+
+// response tags, as written by the server
+enum
+{
+    SER_NIL = 0,
+    SER_ERR = 1,
+    SER_STR = 2,
+    SER_INT = 3,
+    SER_ARR = 4,
+    SER_DBL = 5,
+};
+
+// Error code of a reply made up by the client because the request could
+// not be sent or the connection was lost before its response
+const int32_t k_kv_err_conn = -1;
+// Arrays nested deeper than this are rejected as malformed, which bounds
+// the stack used to decode
+const uint32_t k_kv_max_depth = 64;
+
+// A decoded response. Strings point into the buffer the value was decoded
+// from, so nothing is copied, and are only valid as long as that buffer.
+struct KVValue
+{
+    uint8_t type = SER_NIL;
+    int32_t code = 0;         // SER_ERR
+    int64_t i = 0;            // SER_INT
+    double d = 0;             // SER_DBL
+    std::string_view str;     // SER_STR, or the message of SER_ERR
+    std::vector<KVValue> arr; // SER_ARR
+    std::string_view raw;     // the encoded bytes of this value
+};
+
+// Decodes one value, returns the bytes it used or -1 if it is malformed
+// or incomplete
+int64_t kv_decode(const uint8_t *data, size_t size, KVValue *out);
+// Appends a request with its length header
+void kv_encode(std::string &out, const std::string_view *args, size_t n);
+void kv_encode(std::string &out, std::initializer_list<std::string_view> args);
+
+// A response that owns its bytes, for futures
+struct KVReply
+{
+    std::vector<uint8_t> raw;
+    KVValue value; // points into raw
+
+    KVReply() = default;
+    explicit KVReply(std::string_view bytes);
+    KVReply(const KVReply &) = delete;
+    KVReply &operator=(const KVReply &) = delete;
+    KVReply(KVReply &&) = default;
+    KVReply &operator=(KVReply &&) = default;
+};
+
+// One non-blocking connection, for callers with their own event loop.
+// Requests are queued with send() and written together by flush(), and
+// read() runs the callbacks of complete responses in request order. The
+// value passed to a callback is only valid during the call. Not thread
+// safe.
+class KVConn
+{
+public:
+    using Callback = std::function<void(const KVValue &)>;
+
+    int fd = -1;
+    bool broken = false;
+    std::string error; // why it broke
+    Buffer rbuf;
+    std::string wbuf;
+    size_t wbuf_sent = 0;
+    std::deque<Callback> pending; // sent or queued, oldest first
+
+    KVConn() = default;
+    ~KVConn();
+    KVConn(const KVConn &) = delete;
+    KVConn &operator=(const KVConn &) = delete;
+
+    // Starts connecting to an IPv4 address, false on an immediate error.
+    // A broken connection may be connected again.
+    bool connect(const char *host, uint16_t port);
+    // Takes over a connected socket
+    void attach(int fd);
+
+    void send(const std::string_view *args, size_t n, Callback cb);
+    void send(std::initializer_list<std::string_view> args, Callback cb);
+    // Writes as much of the queue as the socket takes, false once broken
+    bool flush();
+    // Reads what is available and dispatches the responses, false once broken
+    bool read();
+    bool want_write() const { return wbuf_sent < wbuf.size(); }
+    // Fails every pending request with k_kv_err_conn and closes the socket
+    void fail(const char *msg);
+};
+
+// Thread safe client over a pool of connections, driven by its own IO
+// thread. Any thread may call send() or call(). Requests that arrive
+// while the IO thread is busy are coalesced into one write per
+// connection, so concurrent callers are pipelined without batching on
+// their side. A connection that breaks fails the requests in flight on
+// it and is reconnected when the next request for it arrives. Callbacks
+// run on the IO thread.
+class KVClient
+{
+public:
+    KVClient(const char *host, uint16_t port, size_t nconns = 1);
+    // Fails the requests still in flight
+    ~KVClient();
+    KVClient(const KVClient &) = delete;
+    KVClient &operator=(const KVClient &) = delete;
+
+    void send(const std::string_view *args, size_t n, KVConn::Callback cb);
+    void send(std::initializer_list<std::string_view> args, KVConn::Callback cb);
+    std::future<KVReply> call(const std::string_view *args, size_t n);
+    std::future<KVReply> call(std::initializer_list<std::string_view> args);
+
+private:
+    // A connection and the requests submitted to it, not yet handed to
+    // the IO thread
+    struct Slot
+    {
+        KVConn conn;
+        std::mutex mu; // protects the fields below
+        std::string outbox;
+        std::vector<KVConn::Callback> outbox_cbs;
+        bool watched_out = false; // EPOLLOUT is registered, IO thread only
+    };
+
+    std::string host;
+    uint16_t port = 0;
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::atomic<size_t> next{0}; // round robin over slots
+    std::atomic<bool> stop{false};
+    int epfd = -1;
+    int wakefd = -1;
+    std::thread io;
+
+    void loop();
+    bool connect(Slot *slot);
+    void take_outbox(Slot *slot);
+    void watch(Slot *slot);
+};
+
+#endif
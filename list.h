@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+#ifndef LIST_H
+#define LIST_H
+
+// Intrusive circular doubly-linked list. An empty list is a head that
+// points at itself, so insertion and removal never branch on the ends.
+struct DList
+{
+    DList *prev = NULL;
+    DList *next = NULL;
+};
+
+inline void dlist_init(DList *node)
+{
+    node->prev = node->next = node;
+}
+
+inline bool dlist_empty(DList *node)
+{
+    return node->next == node;
+}
+
+inline void dlist_detach(DList *node)
+{
+    DList *prev = node->prev;
+    DList *next = node->next;
+    prev->next = next;
+    next->prev = prev;
+}
+
+// insert `rookie` before `target`, before the head means at the tail
+inline void dlist_insert_before(DList *target, DList *rookie)
+{
+    DList *prev = target->prev;
+    prev->next = rookie;
+    rookie->prev = prev;
+    rookie->next = target;
+    target->prev = rookie;
+}
+
+#endif
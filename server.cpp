@@ -1,4 +1,5 @@
 #include <string.h>
+#include <math.h>
 #include <iostream>
 #include <errno.h>
 #include <unistd.h>
@@ -8,13 +9,77 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <vector>
-#include <poll.h>
+#include <deque>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <time.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <malloc.h>
 #include "hashtable.h"
 #include <string>
+#include <string_view>
+#include <charconv>
 #include "avl.h"
+#include "zset.h"
+#include "buffer.h"
+#include "hash.h"
+#include "heap.h"
+#include "list.h"
+#include "snapshot.h"
+#include "slab.h"
+#include "stats.h"
+#include "trace.h"
 
-const size_t k_max_msg = 4096;
-const size_t k_max_args = 1024;
+// Buffers grow on demand, so this is only a cap on a single message
+const size_t k_max_msg = 32 << 20;
+// Per-thread read size, requests that arrive whole are parsed in place
+const size_t k_read_chunk = 64 << 10;
+// Output buffers above this are released once flushed
+const size_t k_wbuf_keep = 4096;
+// Enough for an mset of 2000 pairs
+const size_t k_max_args = 4096;
+// Arguments kept inline before parsing falls back to the heap
+const size_t k_inline_args = 16;
+const size_t k_max_events = 1024;
+// Keys expired per loop iteration, so a mass expiry cannot stall clients
+const size_t k_max_works = 2000;
+// Keys looked up together by a multi-key command or a run of pipelined
+// requests, see KeyBatch
+const size_t k_batch_group = 16;
+// Keys sampled per eviction, more is closer to true LRU/LFU but slower
+const size_t k_evict_samples = 5;
+// LFU counter: starting value, so new keys are not evicted right away,
+// and minutes for the counter to decay by one when the key is not used
+const uint32_t k_lfu_init = 5;
+const uint32_t k_lfu_log_factor = 10;
+const uint32_t k_lfu_decay_min = 1;
+// Entries at least this big are freed on the lazy free thread
+const size_t k_lazyfree_mem = 64 << 10;
+// SCAN cursors keep the shard in the low bits and the slot cursor above
+const uint32_t k_scan_shard_bits = 16;
+// Default number of keys returned by one SCAN call
+const size_t k_scan_count = 10;
+// The log is rewritten once it doubles since the last rewrite and is at
+// least this big
+const uint64_t k_aof_rewrite_min = 64 << 20;
+// Below this, the writes made during a rewrite are copied with writes blocked
+const size_t k_aof_catchup = 1 << 20;
+// Arguments of a slow log entry beyond these are summarized
+const size_t k_slowlog_args = 32;
+const size_t k_slowlog_arg_len = 128;
+// The trace rings are drained this often while tracing
+const uint32_t k_trace_drain_us = 1000;
 
 enum
 {
@@ -37,44 +102,424 @@ enum
     SER_STR = 2,
     SER_INT = 3,
     SER_ARR = 4,
+    SER_DBL = 5,
 };
 
 enum
 {
     ERR_UNKNOWN = 1,
     ERR_2BIG = 2,
+    ERR_TYPE = 3,
+    ERR_ARG = 4,
+};
+
+// value types
+enum
+{
+    T_STR = 0,
+    T_ZSET = 1,
+};
+
+// commands, for the per command stats
+enum
+{
+    CMD_KEYS,
+    CMD_SCAN,
+    CMD_GET,
+    CMD_SET,
+    CMD_DEL,
+    CMD_UNLINK,
+    CMD_MGET,
+    CMD_MSET,
+    CMD_MDEL,
+    CMD_ZADD,
+    CMD_ZREM,
+    CMD_ZSCORE,
+    CMD_ZRANK,
+    CMD_ZQUERY,
+    CMD_EXPIRE,
+    CMD_PEXPIRE,
+    CMD_TTL,
+    CMD_PTTL,
+    CMD_PEXPIREAT,
+    CMD_SAVE,
+    CMD_BGSAVE,
+    CMD_BGREWRITEAOF,
+    CMD_MEMORY,
+    CMD_INFO,
+    CMD_SLOWLOG,
+    CMD_TRACE,
+    CMD_UNKNOWN,
+    CMD_COUNT,
+};
+
+static const char *const k_cmd_names[CMD_COUNT] = {
+    "keys", "scan", "get", "set", "del", "unlink", "mget", "mset", "mdel", "zadd", "zrem",
+    "zscore", "zrank", "zquery", "expire", "pexpire", "ttl", "pttl", "pexpireat", "save",
+    "bgsave", "bgrewriteaof", "memory", "info", "slowlog", "trace", "unknown",
+};
+
+// fsync policies of the append only file
+enum
+{
+    FSYNC_ALWAYS = 0,
+    FSYNC_EVERYSEC = 1,
+    FSYNC_NO = 2,
+};
+
+// eviction policies once maxmemory is reached
+enum
+{
+    EVICT_LRU = 0,
+    EVICT_LFU = 1,
 };
 
 // The data structure for the key space. This is just a placeholder
 // until we implement a hashtable in the next chapter.
 // static std::map<std::string, std::string> g_map;
 
+// One partition of the key space. A key lives in the shard picked by
+// its hash, and the shard is locked by whichever worker runs the command.
+struct Shard
+{
+    std::mutex mu;
+    HMap db;
+    // TTL timers of the keys in this shard, expired by the owning worker
+    std::vector<HeapItem> heap;
+    int wakefd = -1; // eventfd of the owning worker
+    // bytes held by the entries, kept within maxmemory / nshards
+    size_t used_memory = 0;
+    size_t evicted = 0;
+    // entries of this shard, used under its lock
+    Slab slab;
+};
+
 // The data structure for key space
 static struct
 {
-    HMap db;
+    Shard *shards = NULL;
+    uint32_t nshards = 0;
 } g_data;
 
+// Entries waiting to be freed by the lazy free thread. Producers push
+// with a CAS and the thread takes the whole stack at once, so there is
+// no ABA problem. The stack is linked through HNode::next, which is
+// unused once the entry is out of the map.
+static struct
+{
+    std::atomic<HNode *> head{NULL};
+    int wakefd = -1;
+} g_lazyfree;
+
+// Append only file. Writes are appended to `buf` in the request format
+// while the shard lock is held, so the log keeps the order of the writes
+// to each key, and the buffer is written out once per loop iteration.
+static struct
+{
+    bool enabled = false;
+    std::string path;
+    uint32_t fsync = FSYNC_EVERYSEC;
+
+    std::mutex mu; // protects the 3 fields below
+    std::string buf;
+    bool rewriting = false;
+    std::string rewrite_buf; // writes made since the rewrite forked
+
+    std::mutex flush_mu; // orders the writes to fd
+    int fd = -1;
+    uint64_t size = 0;      // bytes in the file
+    uint64_t base_size = 0; // size after the last rewrite
+    std::mutex fsync_mu;    // keeps fd open during a background fsync
+} g_aof;
+
+// Snapshot file, and the metrics of the last save
+static struct
+{
+    std::string path = "dump.snap";
+    std::mutex mu; // protects the fields below
+    bool running = false;
+    bool last_ok = true;
+    uint64_t last_save_ms = 0; // wall clock
+    uint64_t fork_us = 0;      // time the parent was blocked in fork()
+    uint64_t cow_bytes = 0;    // pages copied while the child was writing
+    uint64_t duration_ms = 0;
+    uint64_t bytes = 0;
+} g_save;
+
+// With --mmap the snapshot is mapped instead of loaded. A key missing
+// from the shards is looked up in the file's index and copied into memory
+// on first access. The dead bitmap has a bit per index slot, set once
+// the key was copied, overwritten or deleted, so the record is ignored.
+static struct
+{
+    bool enabled = false;
+    SnapFile file;
+    uint64_t *dead = NULL; // bits are set under the lock of the key's shard
+} g_overlay;
+
+// set when this thread logged a write that is not flushed yet
+static thread_local bool t_aof_dirty = false;
+
+static struct
+{
+    uint32_t nthreads = 0; // 0 means one worker per core
+    uint64_t idle_timeout_ms = 0; // 0 keeps idle connections forever
+    uint64_t maxmemory = 0; // 0 means no limit
+    uint32_t evict_policy = EVICT_LRU;
+    bool mmap_snapshot = false; // map the snapshot instead of loading it
+} g_conf;
+
+// Metrics of one worker, written only by its thread and read by INFO
+struct WorkerStats
+{
+    // ticks spent in each command, see tsc_now()
+    Histogram latency[CMD_COUNT];
+    std::atomic<uint64_t> poll_ticks{0}; // blocked in epoll_wait()
+    std::atomic<uint64_t> wakeups{0};    // epoll_wait() calls that returned events
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> conns{0}; // open now
+    std::atomic<uint64_t> accepted{0};
+};
+
+// A command that took longer than the threshold, see SLOWLOG
+struct SlowEntry
+{
+    uint64_t id = 0;
+    uint64_t time_ms = 0; // wall clock
+    uint64_t usec = 0;
+    int fd = -1;
+    std::vector<std::string> args; // cut to k_slowlog_args
+};
+
+// Commands slower than threshold_us, the newest first. Slow commands are
+// rare, so a mutex is fine.
+static struct
+{
+    int64_t threshold_us = 10000; // -1 disables, 0 logs every command
+    size_t max_len = 128;
+    // threshold_us in ticks, set by slowlog_set_threshold() once the tick
+    // rate is known, nothing is logged before that
+    std::atomic<uint64_t> threshold_ticks{UINT64_MAX};
+    std::mutex mu; // protects the fields below
+    std::deque<SlowEntry> entries;
+    uint64_t next_id = 0;
+} g_slowlog;
+
+// Request tracing, switched at runtime with TRACE ON|OFF. Each worker
+// pushes a record per request to its own ring and the drain thread
+// appends them to the trace file.
+static struct
+{
+    std::atomic<bool> enabled{false};
+    std::string path = "trace.log";
+} g_trace;
+
+// One event loop, pinned to its own thread with its own listening socket
+struct Worker
+{
+    uint32_t id = 0;
+    int fd = -1;   // SO_REUSEPORT listener
+    int epfd = -1;
+    int wakefd = -1; // signalled when another thread moves a timer earlier
+    // A map of all client connections of this worker keyed by fd
+    std::vector<struct Conn *> fd2conn;
+    // connections ordered by last activity, the least recent first
+    DList idle_list;
+    std::thread thread;
+    WorkerStats *stats = NULL;
+    TraceRing *trace = NULL; // only pushed to while tracing
+};
+
+static struct
+{
+    Worker *workers = NULL;
+    uint32_t nworkers = 0;
+} g_workers;
+
 struct Conn
 {
     int fd = -1;
     uint32_t state = 0;
+    uint32_t events = 0; // epoll interest currently registered for fd
+
+    // timer for idle connections
+    uint64_t idle_start = 0;
+    DList idle_list;
+    // bytes of output the kernel still held when the idle timer last fired
+    int outq_seen = 0;
 
-    size_t rbuf_size = 0;
-    size_t rbuf_read = 0;
-    uint8_t rbuf[4 + k_max_msg];
+    // Only holds a partial request carried over between reads, empty when idle
+    Buffer rbuf;
 
-    size_t wbuf_size = 0;
+    // Responses to every request parsed from one read are appended here
+    // and flushed together
+    std::string wbuf;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+};
+
+// encodings of a T_STR value, see Entry
+enum
+{
+    ENC_EMBSTR = 0, // varint length and bytes
+    ENC_INT = 1,    // a decimal integer as a raw int64, like OBJ_ENCODING_INT
+    ENC_RAW = 2,    // pointer to a malloc()ed RawStr
+};
+
+// A string value too large to be stored in its entry
+struct RawStr
+{
+    uint32_t len;
+    char data[0];
 };
 
 // the structure for the key
+// An entry is a chunk of its shard's slab: the fields below, then the key
+// as a varint length and bytes, then the value. A T_STR value is stored in
+// its `enc` encoding, a T_ZSET as its ZSet pointer. Chunks leave room for
+// at least a pointer after the key, so any value can replace another in
+// place. Fields after the key are unaligned and accessed with memcpy().
 struct Entry
 {
     struct HNode node;
-    std::string key;
-    std::string val;
+    // position in the shard's TTL heap, -1 without a TTL
+    size_t heap_idx = -1;
+    // access clock for eviction, see entry_touch()
+    uint32_t access = 0;
+    uint8_t type = T_STR;
+    uint8_t enc = ENC_INT;
+    uint8_t cls = 0; // slab size class of the chunk
+    char data[0];
+};
+
+// decimal digits of an int64, with the sign
+const size_t k_int_len = 20;
+
+static size_t varint_len(uint64_t v)
+{
+    size_t n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static size_t varint_put(char *p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+// Only for varints written by varint_put()
+static size_t varint_get(const char *p, uint64_t *v)
+{
+    size_t n = 0;
+    int shift = 0;
+    *v = 0;
+    while ((uint8_t)p[n] & 0x80)
+    {
+        *v |= (uint64_t)((uint8_t)p[n++] & 0x7f) << shift;
+        shift += 7;
+    }
+    *v |= (uint64_t)(uint8_t)p[n++] << shift;
+    return n;
+}
+
+static std::string_view entry_key(const Entry *ent)
+{
+    uint64_t klen = 0;
+    size_t n = varint_get(ent->data, &klen);
+    return std::string_view(ent->data + n, klen);
+}
+
+// Where the value starts
+static char *entry_tail(Entry *ent)
+{
+    std::string_view key = entry_key(ent);
+    return (char *)key.data() + key.size();
+}
+
+static size_t entry_chunk(Entry *ent)
+{
+    return ent->cls < k_slab_nclass ? slab_class_size(ent->cls) : malloc_usable_size(ent);
+}
+
+static RawStr *entry_raw(Entry *ent)
+{
+    assert(ent->type == T_STR && ent->enc == ENC_RAW);
+    RawStr *raw = NULL;
+    memcpy(&raw, entry_tail(ent), sizeof(raw));
+    return raw;
+}
+
+static ZSet *entry_zset(Entry *ent)
+{
+    assert(ent->type == T_ZSET);
+    ZSet *zset = NULL;
+    memcpy(&zset, entry_tail(ent), sizeof(zset));
+    return zset;
+}
+
+// The string value, an integer is formatted into `buf`
+static std::string_view entry_val(Entry *ent, char (&buf)[k_int_len])
+{
+    const char *tail = entry_tail(ent);
+    if (ent->enc == ENC_INT)
+    {
+        int64_t val = 0;
+        memcpy(&val, tail, sizeof(val));
+        char *end = std::to_chars(buf, buf + k_int_len, val).ptr;
+        return std::string_view(buf, end - buf);
+    }
+    if (ent->enc == ENC_RAW)
+    {
+        RawStr *raw = entry_raw(ent);
+        return std::string_view(raw->data, raw->len);
+    }
+    uint64_t vlen = 0;
+    size_t n = varint_get(tail, &vlen);
+    return std::string_view(tail + n, vlen);
+}
+
+// The arguments of one request as views into the read buffer. Up to
+// k_inline_args they are stored inline, so parsing does not allocate.
+struct ReqArgs
+{
+    std::string_view small[k_inline_args];
+    std::vector<std::string_view> large;
+    std::string_view *items = small;
+    size_t n = 0;
+
+    ReqArgs() = default;
+    ReqArgs(const ReqArgs &) = delete;
+    ReqArgs &operator=(const ReqArgs &) = delete;
+
+    size_t size() const { return n; }
+    std::string_view &operator[](size_t i) { return items[i]; }
+
+    void push_back(std::string_view arg)
+    {
+        if (n == k_inline_args)
+        {
+            large.assign(small, small + n);
+        }
+        if (n < k_inline_args)
+        {
+            small[n++] = arg;
+            return;
+        }
+        large.push_back(arg);
+        items = large.data();
+        n++;
+    }
 };
 
 #define container_of(ptr, type, member) ({                  \
@@ -85,23 +530,29 @@ static bool try_fill_buffer(Conn *conn);
 static void msg(const char *msg);
 static void die(const char *msg);
 static void fd_set_nb(int fd);
-static int32_t read_full(int fd, char *buf, size_t n);
-static int32_t write_all(int fd, char *buf, size_t n);
-static int32_t one_request(int connfd);
 static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn);
-static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int32_t fd);
+static int32_t accept_new_conn(Worker *w);
+static void conn_watch(int epfd, Conn *conn);
+static void conn_done(Worker *w, Conn *conn);
 static void state_res(Conn *conn);
-static bool try_one_request(struct Conn *conn);
+static size_t try_one_request(struct Conn *conn, const uint8_t *data, size_t size);
+static size_t try_key_batch(Conn *conn, const uint8_t *data, size_t size);
+static void end_response(Conn *conn, size_t header);
 static bool try_flush_buffer(struct Conn *conn);
+static bool aof_must_wait();
 
-static void do_request(std::vector<std::string> &cmd, std::string &out);
-static int32_t parse_req(const uint8_t *data, uint32_t len, std::vector<std::string> &cmd);
+static void do_request(ReqArgs &cmd, std::string &out, Conn *conn);
+static void request_done(ReqArgs &cmd, uint32_t id, uint64_t ticks, Conn *conn);
+static int32_t parse_req(const uint8_t *data, uint32_t len, ReqArgs &cmd);
 
 static void out_nil(std::string &out);
-static void out_str(std::string &out, const std::string &val);
+static void out_str(std::string &out, std::string_view val);
 static void out_int(std::string &out, int64_t val);
+static void out_dbl(std::string &out, double val);
 static void out_err(std::string &out, int32_t code, const std::string &msg);
 static void out_arr(std::string &out, uint32_t n);
+static size_t out_begin_arr(std::string &out);
+static void out_end_arr(std::string &out, size_t ctx, uint32_t n);
 
 static void msg(const char *msg)
 {
@@ -111,120 +562,106 @@ static void msg(const char *msg)
 static void die(const char *msg)
 {
     int err = errno;
-    std::cerr << msg << std::endl;
+    std::cerr << msg;
+    if (err)
+    {
+        std::cerr << ": " << strerror(err);
+    }
+    std::cerr << std::endl;
     abort();
 }
 
-static u_int64_t str_hash(const uint8_t *data, size_t len)
+static thread_local Worker *t_worker = NULL;
+
+static uint64_t get_monotonic_msec()
 {
-    u_int64_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++)
-    {
-        h = (h + data[i]) * 0x01000193;
-    }
-    return h;
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
 }
 
-static void fd_set_nb(int fd)
+// Wall clock, for deadlines that must survive a restart
+static uint64_t get_realtime_msec()
 {
-    errno = 0;
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (errno)
-    {
-        die("fcntl error");
-        return;
-    }
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
 
-    flags |= O_NONBLOCK;
+static uint64_t get_realtime_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
 
-    errno = 0;
-    (void)fcntl(fd, F_SETFL, flags);
-    if (errno)
-    {
-        die("fcntl error");
-    }
+static uint64_t get_monotonic_usec()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
-static int32_t read_full(int fd, char *buf, size_t n)
+static bool write_full(int fd, const char *buf, size_t n)
 {
     while (n > 0)
     {
-        ssize_t rv = read(fd, buf, n); // Read exactly n bytes from buf
+        ssize_t rv = write(fd, buf, n);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
         if (rv <= 0)
         {
-            return -1;
+            return false;
         }
-        assert((size_t)rv <= n);
         n -= (size_t)rv;
         buf += rv;
     }
-    return 0;
+    return true;
 }
 
-static int32_t write_all(int fd, char *buf, size_t n)
+// Syncs the directory holding `path`, so that a rename into it survives
+// a crash
+static bool fsync_dir(const std::string &path)
 {
-    while (n > 0)
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
     {
-        ssize_t rv = write(fd, buf, n); // Write exactly n bytes into buf
-        if (rv <= 0)
-        {
-            return -1;
-        }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
+        return false;
     }
-    return 0;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
 }
 
-static int32_t one_request(int connfd)
+static Shard *shard_of(u_int64_t hcode)
 {
-    char rbuf[4 + k_max_msg + 1];
-    errno = 0;
-    int32_t err = read_full(connfd, rbuf, 4); // Read 4 bytes (the header which signifies length of msg)
-                                              // 4 bytes cuz length is in unit format .. which is 4 bytes
+    // The low bits pick the HTab slot, use the high bits for the shard
+    // so that every shard still spreads its keys over all slots
+    return &g_data.shards[(hcode >> 32) % g_data.nshards];
+}
 
-    if (err)
+static void fd_set_nb(int fd)
+{
+    errno = 0;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (errno)
     {
-        if (errno == 0)
-        {
-            msg("EOF");
-        }
-        else
-        {
-            msg("read() error");
-        }
-        return err;
+        die("fcntl error");
+        return;
     }
 
-    uint32_t len = 0;
-    memcpy(&len, rbuf, 4); // Copy rbuf into len cuz it currently contains the length of the msg
-                           // which about to be read next
-
-    if (len > k_max_msg)
-    {
-        msg("too long");
-        return -1;
-    }
+    flags |= O_NONBLOCK;
 
-    err = read_full(connfd, &rbuf[4], len);
-    if (err)
+    errno = 0;
+    (void)fcntl(fd, F_SETFL, flags);
+    if (errno)
     {
-        msg("read() error");
-        return err;
+        die("fcntl error");
     }
-
-    rbuf[4 + len] = '\0';
-    std::cout << "client says: " << &rbuf[4] << std::endl;
-
-    const char reply[] = "world";
-    char wbuf[4 + sizeof(reply)];
-
-    len = (uint32_t)strlen(reply);
-    memcpy(wbuf, &len, 4);        // First we write the header (i.e., the length of the reply msg)
-    memcpy(&wbuf[4], reply, len); // Now the real msg is copied into the write buffer
-
-    return write_all(connfd, wbuf, len + 4);
 }
 
 static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
@@ -236,15 +673,18 @@ static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
     fd2conn[conn->fd] = conn;
 }
 
-static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int32_t fd)
+static int32_t accept_new_conn(Worker *w)
 {
     struct sockaddr_in client_addr = {};
     socklen_t len = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &len);
+    int connfd = accept(w->fd, (struct sockaddr *)&client_addr, &len);
 
     if (connfd < 0)
     {
-        msg("accept() error");
+        if (errno != EAGAIN)
+        {
+            msg("accept() error");
+        }
         return -1;
     }
 
@@ -259,38 +699,126 @@ static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int32_t fd)
 
     conn->fd = connfd;
     conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
     conn->wbuf_sent = 0;
-    conn_put(fd2conn, conn);
+    conn->idle_start = get_monotonic_msec();
+    dlist_insert_before(&w->idle_list, &conn->idle_list);
+    conn_put(w->fd2conn, conn);
+
+    // Registered once here, afterwards only the interest changes
+    conn_watch(w->epfd, conn);
+    stat_add(w->stats->conns, 1);
+    stat_add(w->stats->accepted, 1);
 
     return 0;
 }
 
+static void conn_watch(int epfd, Conn *conn)
+{
+    uint32_t events = (conn->state == STATE_REQ) ? EPOLLIN : EPOLLOUT;
+    if (events == conn->events)
+    {
+        // interest unchanged, no syscall needed
+        return;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    int op = conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epfd, op, conn->fd, &ev))
+    {
+        die("epoll_ctl()");
+    }
+    conn->events = events;
+}
+
+// Restarts the idle timer on progress in either direction, so a client
+// slowly draining a large reply is not cut off mid-response. Moves the
+// connection to the tail of the idle list, O(1).
+static void conn_touch(Conn *conn)
+{
+    conn->idle_start = get_monotonic_msec();
+    dlist_detach(&conn->idle_list);
+    dlist_insert_before(&t_worker->idle_list, &conn->idle_list);
+}
+
+// Whether the reader is still draining output queued in the kernel. A
+// large reply sits in the socket buffer while a slow client consumes it,
+// with no write from us for longer than the idle timeout.
+static bool conn_draining(Conn *conn)
+{
+    int outq = 0;
+    if (ioctl(conn->fd, SIOCOUTQ, &outq) != 0 || outq == 0 || outq == conn->outq_seen)
+    {
+        return false;
+    }
+    conn->outq_seen = outq;
+    return true;
+}
+
+static void conn_done(Worker *w, Conn *conn)
+{
+    (void)epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    w->fd2conn[conn->fd] = NULL;
+    dlist_detach(&conn->idle_list);
+    (void)close(conn->fd);
+    delete conn;
+    stat_add(w->stats->conns, (uint64_t)-1);
+}
+
 static void state_req(Conn *conn)
 {
     while (try_fill_buffer(conn))
         ;
 }
 
+static size_t handle_requests(Conn *conn, const uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size)
+    {
+        size_t n = try_key_batch(conn, &data[pos], size - pos);
+        if (n == 0)
+        {
+            n = try_one_request(conn, &data[pos], size - pos);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
 static bool try_fill_buffer(Conn *conn)
 {
-    assert(conn->rbuf_size + conn->rbuf_read < sizeof(conn->rbuf));
-    int32_t rv = 0;
+    static thread_local uint8_t scratch[k_read_chunk];
 
-    // Move buffer data to the beginning
-    // removing the data which has been successfully written to the write buffer
-    memmove(conn->rbuf, &conn->rbuf[conn->rbuf_read], conn->rbuf_size);
-    conn->rbuf_read = 0;
+    // With no partial request pending, read into the per-thread scratch
+    // and parse it in place. Otherwise read straight into rbuf, sized for
+    // the rest of the pending message so a large value lands in one piece.
+    uint8_t *dst = scratch;
+    size_t cap = sizeof(scratch);
+    size_t pending = conn->rbuf.size();
+    if (pending > 0)
+    {
+        if (pending >= 4)
+        {
+            uint32_t len = 0;
+            memcpy(&len, conn->rbuf.data(), 4);
+            if (len <= k_max_msg && 4 + (size_t)len > pending)
+            {
+                cap = std::max(cap, 4 + (size_t)len - pending);
+            }
+        }
+        dst = conn->rbuf.reserve(cap);
+    }
 
+    ssize_t rv = 0;
     do
     {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        // std::cout << "Read start" << std::endl;
-
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-        // std::cout << "Read Successful" << std::endl;
-
+        rv = read(conn->fd, dst, cap);
     } while (rv < 0 && errno == EINTR);
 
     if (rv < 0 && errno == EAGAIN)
@@ -305,253 +833,2899 @@ static bool try_fill_buffer(Conn *conn)
     }
     else if (rv == 0)
     {
-        if (conn->rbuf_size > 0)
+        if (pending > 0)
         {
-            msg("EOF");
-        }
-        else
-        {
-            // msg("unexpected EOF");
+            msg("unexpected EOF");
         }
+        conn->state = STATE_END;
         return false;
     }
 
-    conn->rbuf_size += (size_t)rv;
+    stat_add(t_worker->stats->bytes_read, (uint64_t)rv);
+    conn_touch(conn);
+    if (dst == scratch)
+    {
+        size_t used = handle_requests(conn, scratch, (size_t)rv);
+        if (conn->state == STATE_REQ && used < (size_t)rv)
+        {
+            // Only the incomplete tail is copied
+            conn->rbuf.append(&scratch[used], (size_t)rv - used);
+        }
+    }
+    else
+    {
+        conn->rbuf.commit((size_t)rv);
+        conn->rbuf.consume(handle_requests(conn, conn->rbuf.data(), conn->rbuf.size()));
+        if (conn->rbuf.size() == 0)
+        {
+            conn->rbuf.release();
+        }
+    }
 
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
-    while (try_one_request(conn))
-        ;
+    // Flush the responses of the whole batch with one syscall
+    if (conn->state == STATE_REQ && !conn->wbuf.empty())
+    {
+        conn->state = STATE_RES;
+        if (!aof_must_wait())
+        {
+            state_res(conn);
+        }
+        // else the log is synced at the end of this loop iteration and
+        // the reply goes out on the next EPOLLOUT
+    }
     return conn->state == STATE_REQ;
 }
 
-void print_string(uint8_t *buf, int32_t len)
+static size_t try_one_request(struct Conn *conn, const uint8_t *data, size_t size)
 {
-    std::cout << len << " ";
-    for (int i = 0; i < len; i++)
+    // Returns the number of bytes consumed, 0 if no complete request
+
+    if (size < 4)
     {
-        std::cout << (int)buf[i] << " ";
+        // not enough data in the buffer
+        return 0;
     }
-    std::cout << std::endl;
+
+    uint32_t len = 0;
+    memcpy(&len, &data[0], 4);
+
+    if (len > k_max_msg)
+    {
+        msg("too long");
+        conn->state = STATE_END;
+        return 0;
+    }
+
+    if (4 + (size_t)len > size)
+    {
+        // not enough data .. buffer will retry in the next iteration
+        return 0;
+    }
+
+    // Parse the request, the arguments are views into the read buffer
+    ReqArgs cmd;
+    if (0 != parse_req(&data[4], len, cmd))
+    {
+        msg("bad req");
+        conn->state = STATE_END;
+        return 0;
+    }
+
+    // Generate the response straight into the output buffer,
+    // after a placeholder for its length header
+    size_t header = conn->wbuf.size();
+    conn->wbuf.append(4, '\0');
+    do_request(cmd, conn->wbuf, conn);
+    end_response(conn, header);
+
+    // The response is flushed once the whole batch has been processed
+    return 4 + (size_t)len;
+}
+
+// Fills in the length header of the response that starts at `header`
+static void end_response(Conn *conn, size_t header)
+{
+    if (conn->wbuf.size() - header > k_max_msg)
+    {
+        conn->wbuf.resize(header + 4);
+        out_err(conn->wbuf, ERR_2BIG, "response is too big");
+    }
+
+    uint32_t wlen = (uint32_t)(conn->wbuf.size() - header - 4);
+    memcpy(&conn->wbuf[header], &wlen, 4);
+}
+
+static bool cmd_is(std::string_view req, const char *cmd)
+{
+    return req.size() == strlen(cmd) && strncasecmp(req.data(), cmd, req.size()) == 0;
+}
+
+static int32_t parse_req(const uint8_t *data, uint32_t len, ReqArgs &cmd)
+{
+    if (len < 4)
+    {
+        return -1;
+    }
+
+    uint32_t n = 0;
+    memcpy(&n, &data[0], 4);
+    if (n > k_max_args)
+    {
+        return -1;
+    }
+    size_t pos = 4;
+    while (n--)
+    {
+        if (pos + 4 > len)
+        {
+            return -1;
+        }
+        uint32_t sz = 0;
+        memcpy(&sz, &data[pos], 4);
+        if (pos + 4 + sz > len)
+        {
+            return -1;
+        }
+        cmd.push_back(std::string_view((char *)&data[pos + 4], sz));
+        pos += 4 + sz;
+    }
+
+    if (pos != len)
+    {
+        return -1; // Trailing garbage
+    }
+    return 0;
+}
+
+static bool entry_eq(HNode *node, const HKey *key)
+{
+    struct Entry *ent = container_of(node, struct Entry, node);
+    std::string_view name = entry_key(ent);
+    return name.size() == key->len && memcmp(name.data(), key->data, key->len) == 0;
+}
+
+static HKey make_key(std::string_view name)
+{
+    HKey key;
+    key.data = (const uint8_t *)name.data();
+    key.len = name.size();
+    key.hcode = str_hash(key.data, key.len);
+    return key;
+}
+
+static void shard_wake(Shard *shard)
+{
+    if (t_worker && shard == &g_data.shards[t_worker->id])
+    {
+        // the owner recomputes its timeout before waiting again
+        return;
+    }
+    uint64_t one = 1;
+    (void)!write(shard->wakefd, &one, sizeof(one));
+}
+
+// Set or remove (ttl_ms < 0) the TTL of a key, the caller holds the shard lock
+static void entry_set_ttl(Shard *shard, Entry *ent, int64_t ttl_ms)
+{
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
+    {
+        // remove the item by moving the last one into its place
+        size_t pos = ent->heap_idx;
+        shard->heap[pos] = shard->heap.back();
+        shard->heap.pop_back();
+        if (pos < shard->heap.size())
+        {
+            heap_update(shard->heap.data(), pos, shard->heap.size());
+        }
+        ent->heap_idx = -1;
+    }
+    else if (ttl_ms >= 0)
+    {
+        size_t pos = ent->heap_idx;
+        if (pos == (size_t)-1)
+        {
+            // add a new item to the heap
+            HeapItem item;
+            item.ref = &ent->heap_idx;
+            shard->heap.push_back(item);
+            pos = shard->heap.size() - 1;
+        }
+        shard->heap[pos].val = get_monotonic_msec() + (uint64_t)ttl_ms;
+        heap_update(shard->heap.data(), pos, shard->heap.size());
+        if (ent->heap_idx == 0)
+        {
+            // the earliest deadline changed
+            shard_wake(shard);
+        }
+    }
+}
+
+static bool hnode_same(HNode *lhs, HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+// Approximate bytes owned by an entry: its slab chunk, its bucket slot and
+// a separate value. malloc overhead is not counted.
+static size_t entry_mem(Entry *ent)
+{
+    size_t mem = entry_chunk(ent) + sizeof(HNode *);
+    if (ent->type == T_STR && ent->enc == ENC_RAW)
+    {
+        mem += sizeof(RawStr) + entry_raw(ent)->len;
+    }
+    if (ent->type == T_ZSET)
+    {
+        mem += sizeof(ZSet) + entry_zset(ent)->mem;
+    }
+    return mem;
+}
+
+// xorshift64*, for sampling only
+static uint64_t fast_rand()
+{
+    static thread_local uint64_t x = 0;
+    if (x == 0)
+    {
+        x = ((uint64_t)(size_t)&x ^ get_monotonic_msec()) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return x * 2685821657736338717ull;
+}
+
+// The LFU clock keeps minutes of the last decay in the high 24 bits and
+// a logarithmic access counter in the low 8 bits.
+static uint32_t lfu_counter(Entry *ent, uint32_t now_min)
+{
+    uint32_t counter = ent->access & 0xff;
+    uint32_t elapsed = (now_min - (ent->access >> 8)) & 0xffffff;
+    uint32_t periods = elapsed / k_lfu_decay_min;
+    return periods < counter ? counter - periods : 0;
+}
+
+// Records an access. LRU keeps the time in milliseconds, wrapping after
+// 49 days, which only matters for keys that old.
+static void entry_touch(Entry *ent)
+{
+    if (!g_conf.maxmemory)
+    {
+        return;
+    }
+    uint64_t now = get_monotonic_msec();
+    if (g_conf.evict_policy == EVICT_LRU)
+    {
+        ent->access = (uint32_t)now;
+        return;
+    }
+    uint32_t now_min = (uint32_t)(now / 60000) & 0xffffff;
+    if (!ent->access)
+    {
+        ent->access = (now_min << 8) | k_lfu_init;
+        return;
+    }
+    uint32_t counter = lfu_counter(ent, now_min);
+    // the more hits, the less likely another one counts
+    if (counter < 255)
+    {
+        uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        if (fast_rand() % (base * k_lfu_log_factor + 1) == 0)
+        {
+            counter++;
+        }
+    }
+    ent->access = (now_min << 8) | counter;
+}
+
+// Higher is a better eviction victim
+static uint64_t evict_score(Entry *ent, uint64_t now)
+{
+    if (g_conf.evict_policy == EVICT_LRU)
+    {
+        return (uint32_t)now - ent->access;
+    }
+    uint32_t now_min = (uint32_t)(now / 60000) & 0xffffff;
+    return 255 - lfu_counter(ent, now_min);
+}
+
+// Adds a new entry to the shard, the caller holds the shard lock
+static void entry_link(Shard *shard, Entry *ent)
+{
+    entry_touch(ent);
+    shard->db.hm_insert(&ent->node);
+    shard->used_memory += entry_mem(ent);
+}
+
+// Removes an entry from the shard, including its TTL. The caller holds
+// the shard lock and frees the entry with entry_free().
+static void entry_unlink(Shard *shard, Entry *ent)
+{
+    HNode *node = shard->db.hm_pop(&ent->node, &hnode_same);
+    assert(node == &ent->node);
+    entry_set_ttl(shard, ent, -1);
+    shard->used_memory -= entry_mem(ent);
+}
+
+// Bytes of a string value stored in an entry, and its encoding
+static size_t val_size(std::string_view val, uint8_t *enc, int64_t *ival)
+{
+    // only a canonical integer, so that formatting it gives back the value
+    if (!val.empty() && val.size() <= k_int_len)
+    {
+        char buf[k_int_len];
+        const char *end = val.data() + val.size();
+        std::from_chars_result rv = std::from_chars(val.data(), end, *ival);
+        if (rv.ec == std::errc() && rv.ptr == end
+            && std::string_view(buf, std::to_chars(buf, buf + k_int_len, *ival).ptr - buf) == val)
+        {
+            *enc = ENC_INT;
+            return sizeof(int64_t);
+        }
+    }
+    *enc = ENC_EMBSTR;
+    return varint_len(val.size()) + val.size();
+}
+
+// Replaces the string value, inline when it fits the rest of the chunk
+static void entry_set_val(Entry *ent, std::string_view val)
+{
+    if (ent->enc == ENC_RAW)
+    {
+        free(entry_raw(ent));
+    }
+    char *tail = entry_tail(ent);
+    size_t room = entry_chunk(ent) - (tail - (char *)ent);
+    int64_t ival = 0;
+    size_t size = val_size(val, &ent->enc, &ival);
+    if (ent->enc == ENC_INT)
+    {
+        memcpy(tail, &ival, sizeof(ival));
+    }
+    else if (size <= room)
+    {
+        size_t n = varint_put(tail, val.size());
+        memcpy(tail + n, val.data(), val.size());
+    }
+    else
+    {
+        RawStr *raw = (RawStr *)malloc(sizeof(RawStr) + val.size());
+        if (!raw)
+        {
+            die("out of memory");
+        }
+        raw->len = (uint32_t)val.size();
+        memcpy(raw->data, val.data(), val.size());
+        memcpy(tail, &raw, sizeof(raw));
+        ent->enc = ENC_RAW;
+    }
+}
+
+// Allocates an unlinked entry holding `val` if it is a T_STR, the caller
+// holds the shard lock
+static Entry *entry_new(Shard *shard, std::string_view key, uint64_t hcode, uint32_t type,
+                        std::string_view val = std::string_view())
+{
+    size_t need = offsetof(Entry, data) + varint_len(key.size()) + key.size();
+    uint8_t enc = ENC_INT;
+    int64_t ival = 0;
+    size_t vsize = type == T_STR ? val_size(val, &enc, &ival) : 0;
+    // a value that would push the chunk out of the slab is kept apart
+    need += need + vsize <= k_slab_max ? std::max(vsize, sizeof(void *)) : sizeof(void *);
+    size_t alloc = 0;
+    void *p = shard->slab.alloc(need, &alloc);
+    if (!p)
+    {
+        die("out of memory");
+    }
+    Entry *ent = new (p) Entry();
+    ent->node.hcode = hcode;
+    ent->type = (uint8_t)type;
+    ent->cls = (uint8_t)slab_class(alloc);
+    size_t n = varint_put(ent->data, key.size());
+    memcpy(ent->data + n, key.data(), key.size());
+    if (type == T_ZSET)
+    {
+        ZSet *zset = new ZSet();
+        memcpy(entry_tail(ent), &zset, sizeof(zset));
+    }
+    else
+    {
+        entry_set_val(ent, val);
+    }
+    return ent;
+}
+
+// Frees what an entry owns outside its chunk
+static void entry_release(Entry *ent)
+{
+    if (ent->type == T_ZSET)
+    {
+        ZSet *zset = entry_zset(ent);
+        zset_dispose(zset);
+        delete zset;
+    }
+    else if (ent->enc == ENC_RAW)
+    {
+        free(entry_raw(ent));
+    }
+    ent->type = T_STR;
+    ent->enc = ENC_INT;
+}
+
+// The caller holds the shard lock
+static void entry_del(Shard *shard, Entry *ent)
+{
+    assert(ent->heap_idx == (size_t)-1);
+    entry_release(ent);
+    shard->slab.free(ent, entry_chunk(ent));
+}
+
+// Frees an unlinked entry. Large entries, or any with `lazy`, are handed
+// to the lazy free thread so that the event loop does not stall on them.
+// The caller holds the shard lock.
+static void entry_free(Shard *shard, Entry *ent, bool lazy)
+{
+    if (!lazy && entry_mem(ent) < k_lazyfree_mem)
+    {
+        return entry_del(shard, ent);
+    }
+    HNode *head = g_lazyfree.head.load(std::memory_order_relaxed);
+    do
+    {
+        ent->node.next = head;
+    } while (!g_lazyfree.head.compare_exchange_weak(
+        head, &ent->node, std::memory_order_release, std::memory_order_relaxed));
+    if (!head)
+    {
+        // the thread sleeps only when the stack is empty
+        uint64_t one = 1;
+        (void)!write(g_lazyfree.wakefd, &one, sizeof(one));
+    }
+}
+
+static void lazyfree_loop()
+{
+    // lowest priority, so it gives way to the event loops but cannot
+    // starve and let garbage pile up
+    (void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+
+    while (true)
+    {
+        uint64_t cnt = 0;
+        if (read(g_lazyfree.wakefd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+        {
+            die("read() lazyfree");
+        }
+        HNode *node = g_lazyfree.head.exchange(NULL, std::memory_order_acquire);
+        while (node)
+        {
+            HNode *next = node->next;
+            Entry *ent = container_of(node, Entry, node);
+            // the chunk goes back under the lock, but the slow part does not
+            entry_release(ent);
+            Shard *shard = shard_of(ent->node.hcode);
+            {
+                std::lock_guard<std::mutex> lock(shard->mu);
+                shard->slab.free(ent, entry_chunk(ent));
+            }
+            node = next;
+        }
+    }
+}
+
+static void aof_encode(std::string &out, const std::string_view *args, size_t n)
+{
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t cnt = (uint32_t)n;
+    out.append((char *)&cnt, 4);
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t sz = (uint32_t)args[i].size();
+        out.append((char *)&sz, 4);
+        out.append(args[i]);
+    }
+}
+
+// Logs a write, the caller holds the lock of the key's shard
+static void aof_log(const std::string_view *args, size_t n)
+{
+    if (!g_aof.enabled)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    size_t start = g_aof.buf.size();
+    aof_encode(g_aof.buf, args, n);
+    if (g_aof.rewriting)
+    {
+        g_aof.rewrite_buf.append(g_aof.buf, start, std::string::npos);
+    }
+    t_aof_dirty = true;
+}
+
+// Keys removed by expiry or eviction are logged as a del
+static void aof_log_del(Entry *ent)
+{
+    std::string_view args[] = {"del", entry_key(ent)};
+    aof_log(args, 2);
+}
+
+static void aof_log_expire(Entry *ent, uint64_t expire_at)
+{
+    std::string at = std::to_string(expire_at);
+    std::string_view args[] = {"pexpireat", entry_key(ent), at};
+    aof_log(args, 3);
+}
+
+// the wall clock time a monotonic deadline corresponds to
+static uint64_t expire_at_real(uint64_t deadline)
+{
+    uint64_t now = get_monotonic_msec();
+    return get_realtime_msec() + (deadline > now ? deadline - now : 0);
+}
+
+// With appendfsync always, replies wait until the log is synced
+static bool aof_must_wait()
+{
+    return g_aof.enabled && g_aof.fsync == FSYNC_ALWAYS && t_aof_dirty;
+}
+
+static bool aof_rewrite_start();
+
+// Writes out the buffered log with one write(), called once per loop
+// iteration. Writes of all workers that arrived meanwhile go out together.
+static void aof_flush()
+{
+    if (!g_aof.enabled)
+    {
+        return;
+    }
+    static thread_local std::string buf;
+    bool rewrite = false;
+    {
+        std::lock_guard<std::mutex> flock(g_aof.flush_mu);
+        {
+            std::lock_guard<std::mutex> lock(g_aof.mu);
+            buf.swap(g_aof.buf);
+        }
+        t_aof_dirty = false;
+        if (buf.empty())
+        {
+            return;
+        }
+        if (!write_full(g_aof.fd, buf.data(), buf.size()))
+        {
+            die("write() aof");
+        }
+        if (g_aof.fsync == FSYNC_ALWAYS && fdatasync(g_aof.fd))
+        {
+            die("fdatasync() aof");
+        }
+        g_aof.size += buf.size();
+        rewrite = g_aof.size >= k_aof_rewrite_min && g_aof.size >= 2 * g_aof.base_size;
+    }
+    buf.clear();
+    if (buf.capacity() > k_aof_catchup)
+    {
+        std::string().swap(buf);
+    }
+    if (rewrite)
+    {
+        (void)aof_rewrite_start();
+    }
+}
+
+static void aof_fsync_loop()
+{
+    while (true)
+    {
+        sleep(1);
+        std::lock_guard<std::mutex> lock(g_aof.fsync_mu);
+        if (fdatasync(g_aof.fd))
+        {
+            msg("fdatasync() aof");
+        }
+    }
+}
+
+// For a consistent view of all data, always taken in shard order
+static void lock_all_shards()
+{
+    for (uint32_t i = 0; i < g_data.nshards; i++)
+    {
+        g_data.shards[i].mu.lock();
+    }
+}
+
+static void unlock_all_shards()
+{
+    for (uint32_t i = g_data.nshards; i-- > 0;)
+    {
+        g_data.shards[i].mu.unlock();
+    }
+}
+
+struct RewriteCtx
+{
+    Shard *shard = NULL;
+    int fd = -1;
+    bool ok = true;
+    std::string buf;
+};
+
+static void cb_rewrite(HNode *node, void *arg)
+{
+    RewriteCtx *ctx = (RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type == T_STR)
+    {
+        char buf[k_int_len];
+        std::string_view args[] = {"set", entry_key(ent), entry_val(ent, buf)};
+        aof_encode(ctx->buf, args, 3);
+    }
+    else if (ent->type == T_ZSET && entry_zset(ent)->tree)
+    {
+        char score[32];
+        AVLNode *it = avl_first(entry_zset(ent)->tree);
+        for (; it; it = avl_next(it))
+        {
+            ZNode *znode = container_of(it, ZNode, tree);
+            snprintf(score, sizeof(score), "%.17g", znode->score);
+            std::string_view args[] = {"zadd", entry_key(ent), score, {znode->name, znode->len}};
+            aof_encode(ctx->buf, args, 4);
+        }
+    }
+    if (ent->heap_idx != (size_t)-1)
+    {
+        std::string at = std::to_string(expire_at_real(ctx->shard->heap[ent->heap_idx].val));
+        std::string_view args[] = {"pexpireat", entry_key(ent), at};
+        aof_encode(ctx->buf, args, 3);
+    }
+    if (ctx->buf.size() >= k_aof_catchup)
+    {
+        ctx->ok = ctx->ok && write_full(ctx->fd, ctx->buf.data(), ctx->buf.size());
+        ctx->buf.clear();
+    }
+}
+
+// Runs in the forked child, which has a copy of the data at the fork.
+// No locks are taken, the threads that could hold them do not exist here.
+static void aof_rewrite_child()
+{
+    std::string tmp = g_aof.path + ".rewrite";
+    RewriteCtx ctx;
+    ctx.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ctx.ok = ctx.fd >= 0;
+    for (uint32_t i = 0; ctx.ok && i < g_data.nshards; i++)
+    {
+        ctx.shard = &g_data.shards[i];
+        ctx.shard->db.ht1.h_scan(&cb_rewrite, &ctx);
+        ctx.shard->db.ht2.h_scan(&cb_rewrite, &ctx);
+    }
+    ctx.ok = ctx.ok && write_full(ctx.fd, ctx.buf.data(), ctx.buf.size());
+    ctx.ok = ctx.ok && fsync(ctx.fd) == 0;
+    _exit(ctx.ok ? 0 : 1);
+}
+
+// Waits for the child, appends the writes made since the fork and
+// replaces the old log with the new one
+static void aof_rewrite_done(pid_t pid)
+{
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    std::string tmp = g_aof.path + ".rewrite";
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    int fd = ok ? open(tmp.c_str(), O_WRONLY | O_APPEND) : -1;
+    ok = fd >= 0;
+
+    // catch up without blocking writers while there is a lot to copy
+    std::string buf;
+    while (ok)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_aof.mu);
+            if (g_aof.rewrite_buf.size() < k_aof_catchup)
+            {
+                break;
+            }
+            buf.swap(g_aof.rewrite_buf);
+        }
+        ok = write_full(fd, buf.data(), buf.size());
+        buf.clear();
+    }
+
+    // the rest with writes blocked
+    std::lock_guard<std::mutex> flock(g_aof.flush_mu);
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    std::string &rest = g_aof.rewrite_buf;
+    ok = ok && write_full(fd, rest.data(), rest.size()) && fsync(fd) == 0;
+    ok = ok && rename(tmp.c_str(), g_aof.path.c_str()) == 0;
+    if (ok && !fsync_dir(g_aof.path))
+    {
+        // the new log is in place and complete, only its name may not be
+        // durable yet, so keep it rather than fail the rewrite
+        msg("aof rewrite: fsync of the directory failed");
+    }
+    if (ok)
+    {
+        struct stat st = {};
+        (void)fstat(fd, &st);
+        {
+            std::lock_guard<std::mutex> slock(g_aof.fsync_mu);
+            close(g_aof.fd);
+            g_aof.fd = fd;
+        }
+        g_aof.size = g_aof.base_size = (uint64_t)st.st_size;
+        // the new file already has everything that is still buffered
+        g_aof.buf.clear();
+        std::cerr << "aof rewritten, " << g_aof.size << " bytes" << std::endl;
+    }
+    else
+    {
+        msg("aof rewrite failed");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        (void)unlink(tmp.c_str());
+        // do not retry on every flush
+        g_aof.base_size = g_aof.size;
+    }
+    g_aof.rewriting = false;
+    std::string().swap(g_aof.rewrite_buf);
+}
+
+// Forks a child that writes the current data set as a new log. All shard
+// locks are held across fork() so the child sees a consistent state, and
+// writes after that point also go to rewrite_buf.
+static bool aof_rewrite_start()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        if (!g_aof.enabled || g_aof.rewriting)
+        {
+            return false;
+        }
+    }
+    lock_all_shards();
+    g_aof.mu.lock();
+    pid_t pid = -1;
+    if (!g_aof.rewriting)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            aof_rewrite_child();
+        }
+        if (pid > 0)
+        {
+            g_aof.rewriting = true;
+            g_aof.rewrite_buf.clear();
+        }
+    }
+    g_aof.mu.unlock();
+    unlock_all_shards();
+
+    if (pid < 0)
+    {
+        return false;
+    }
+    std::thread(aof_rewrite_done, pid).detach();
+    return true;
+}
+
+// Replays the log into the empty data set, before the workers start.
+// A truncated last record, left by a crash in the middle of a write, is
+// cut off. Returns the number of commands.
+static size_t aof_load()
+{
+    int fd = open(g_aof.path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        die("open() aof");
+    }
+    struct stat st = {};
+    if (fstat(fd, &st))
+    {
+        die("fstat() aof");
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        die("mmap() aof");
+    }
+    (void)madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    size_t pos = 0;
+    size_t ncmd = 0;
+    std::string out;
+    while (pos + 4 <= size)
+    {
+        uint32_t len = 0;
+        memcpy(&len, &data[pos], 4);
+        if (len > k_max_msg || pos + 4 + len > size)
+        {
+            break;
+        }
+        ReqArgs cmd;
+        if (parse_req(&data[pos + 4], len, cmd))
+        {
+            std::cerr << "aof is corrupted at offset " << pos << std::endl;
+            exit(1);
+        }
+        out.clear();
+        do_request(cmd, out, NULL);
+        pos += 4 + len;
+        ncmd++;
+    }
+    munmap((void *)data, size);
+
+    if (pos < size)
+    {
+        std::cerr << "aof: dropping a truncated record at offset " << pos << std::endl;
+        if (ftruncate(fd, (off_t)pos))
+        {
+            die("ftruncate() aof");
+        }
+    }
+    close(fd);
+    g_aof.size = g_aof.base_size = pos;
+    return ncmd;
+}
+
+static void aof_init()
+{
+    uint64_t start = get_monotonic_msec();
+    size_t ncmd = aof_load();
+    uint64_t ms = std::max<uint64_t>(get_monotonic_msec() - start, 1);
+    std::cerr << "aof: replayed " << ncmd << " commands, " << g_aof.size << " bytes in "
+              << ms << " ms (" << (double)g_aof.size / ms / 1e6 << " GB/s)" << std::endl;
+
+    g_aof.fd = open(g_aof.path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (g_aof.fd < 0)
+    {
+        die("open() aof");
+    }
+    // logging starts only now, the replay must not log itself again
+    g_aof.enabled = true;
+    if (g_aof.fsync == FSYNC_EVERYSEC)
+    {
+        std::thread(aof_fsync_loop).detach();
+    }
+}
+
+// Snapshot records: u8 type | u8 flags | key | [u64 expire_at] | value,
+// where a string value is a length prefixed string and a zset is a count
+// followed by (f64 score, name) pairs. flags bit 0 means a TTL follows.
+const uint8_t k_snap_ttl = 1;
+
+struct SnapRecord
+{
+    uint8_t type = 0;
+    std::string_view key;
+    uint64_t expire_at = 0; // wall clock, 0 without a TTL
+    uint64_t slot = 0;      // in the index of the mapped snapshot
+};
+
+// Reads a record up to its value
+static bool snap_record_head(SnapReader &r, SnapRecord &rec)
+{
+    rec.type = r.get_u8();
+    uint8_t flags = r.get_u8();
+    rec.key = r.get_str();
+    rec.expire_at = (flags & k_snap_ttl) ? r.get_u64() : 0;
+    return r.ok && (rec.type == T_STR || rec.type == T_ZSET);
+}
+
+static bool snap_record_skip(SnapReader &r, uint8_t type)
+{
+    if (type == T_STR)
+    {
+        r.get_str();
+        return r.ok;
+    }
+    uint64_t n = r.get_varint();
+    for (uint64_t i = 0; i < n && r.ok; i++)
+    {
+        r.get_f64();
+        r.get_str();
+    }
+    return r.ok;
+}
+
+static bool overlay_dead(uint64_t slot)
+{
+    return __atomic_load_n(&g_overlay.dead[slot / 64], __ATOMIC_RELAXED) & (1ull << (slot % 64));
+}
+
+// Slots of keys in different shards share a word, so the bit is set atomically
+static void overlay_set_dead(uint64_t slot)
+{
+    __atomic_fetch_or(&g_overlay.dead[slot / 64], 1ull << (slot % 64), __ATOMIC_RELAXED);
+}
+
+// Reads the record of an index slot up to its value. False for an empty
+// or dead slot, an expired key or a corrupted record.
+static bool overlay_record(uint64_t slot, uint64_t now, SnapRecord &rec, SnapReader &r)
+{
+    const uint8_t *p = g_overlay.file.slot_record(slot);
+    if (!p || overlay_dead(slot))
+    {
+        return false;
+    }
+    r = g_overlay.file.reader(p);
+    rec.slot = slot;
+    return snap_record_head(r, rec) && (!rec.expire_at || rec.expire_at > now);
+}
+
+struct SnapCtx
+{
+    Shard *shard = NULL;
+    SnapWriter *w = NULL;
+    uint64_t nkeys = 0;
+};
+
+static void cb_snap(HNode *node, void *arg)
+{
+    SnapCtx *ctx = (SnapCtx *)arg;
+    SnapWriter *w = ctx->w;
+    Entry *ent = container_of(node, Entry, node);
+    bool ttl = ent->heap_idx != (size_t)-1;
+    w->index_add(ent->node.hcode);
+    w->put_u8((uint8_t)ent->type);
+    w->put_u8(ttl ? k_snap_ttl : 0);
+    w->put_str(entry_key(ent));
+    if (ttl)
+    {
+        w->put_u64(expire_at_real(ctx->shard->heap[ent->heap_idx].val));
+    }
+    if (ent->type == T_STR)
+    {
+        char buf[k_int_len];
+        w->put_str(entry_val(ent, buf));
+    }
+    else
+    {
+        ZSet *zset = entry_zset(ent);
+        w->put_varint(zset->hmap.hm_size());
+        for (AVLNode *it = zset->tree ? avl_first(zset->tree) : NULL; it; it = avl_next(it))
+        {
+            ZNode *znode = container_of(it, ZNode, tree);
+            w->put_f64(znode->score);
+            w->put_str(std::string_view(znode->name, znode->len));
+            w->maybe_flush();
+        }
+    }
+    w->maybe_flush();
+    ctx->nkeys++;
+}
+
+// Writes all shards, one section each, to a temporary file and renames
+// it over the snapshot. The caller holds all shard locks, or is the
+// forked child. Returns the file size, 0 on error.
+static uint64_t snap_write()
+{
+    std::string tmp = g_save.path + ".tmp";
+    SnapWriter w;
+    w.open(tmp.c_str());
+    uint64_t nkeys = 0;
+    for (uint32_t i = 0; i < g_data.nshards; i++)
+    {
+        nkeys += g_data.shards[i].db.hm_size();
+    }
+    for (size_t i = 0; g_overlay.enabled && i < g_overlay.file.sections.size(); i++)
+    {
+        nkeys += g_overlay.file.sections[i].nkeys;
+    }
+    w.index_init(nkeys);
+    for (uint32_t i = 0; w.ok && i < g_data.nshards; i++)
+    {
+        SnapCtx ctx;
+        ctx.shard = &g_data.shards[i];
+        ctx.w = &w;
+        w.begin_section();
+        ctx.shard->db.ht1.h_scan(&cb_snap, &ctx);
+        ctx.shard->db.ht2.h_scan(&cb_snap, &ctx);
+        w.end_section(ctx.nkeys);
+    }
+    if (w.ok && g_overlay.enabled)
+    {
+        // keys still only in the mapped snapshot are copied as they are
+        uint64_t n = 0;
+        uint64_t now = get_realtime_msec();
+        w.begin_section();
+        for (uint64_t slot = 0; slot < g_overlay.file.index_slots; slot++)
+        {
+            SnapRecord rec;
+            SnapReader r(NULL, 0);
+            if (!overlay_record(slot, now, rec, r))
+            {
+                continue;
+            }
+            const uint8_t *start = g_overlay.file.slot_record(slot);
+            if (!snap_record_skip(r, rec.type))
+            {
+                continue;
+            }
+            w.index_add(str_hash((const uint8_t *)rec.key.data(), rec.key.size()));
+            w.buf.append((const char *)start, r.cur - start);
+            w.maybe_flush();
+            n++;
+        }
+        w.end_section(n);
+    }
+    if (!w.finish(get_realtime_msec(), hash_seed()) || rename(tmp.c_str(), g_save.path.c_str())
+        || !fsync_dir(g_save.path))
+    {
+        (void)unlink(tmp.c_str());
+        return 0;
+    }
+    return w.off;
+}
+
+// Private_Dirty of this process, in the child these are the pages that
+// were copied since the fork
+static uint64_t private_dirty_bytes()
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp)
+    {
+        return 0;
+    }
+    char line[256];
+    uint64_t kb = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+static void save_done(bool ok, uint64_t start_ms, uint64_t bytes, uint64_t fork_us, uint64_t cow)
+{
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    g_save.running = false;
+    g_save.last_ok = ok;
+    g_save.duration_ms = get_monotonic_msec() - start_ms;
+    g_save.bytes = bytes;
+    g_save.fork_us = fork_us;
+    g_save.cow_bytes = cow;
+    if (ok)
+    {
+        g_save.last_save_ms = get_realtime_msec();
+    }
+    std::cerr << "save " << (ok ? "done" : "failed") << ": " << bytes << " bytes in "
+              << g_save.duration_ms << " ms, fork " << fork_us << " us, copy-on-write "
+              << cow << " bytes" << std::endl;
+}
+
+// Reports {file size, copied bytes} from the child through a pipe
+static void bgsave_wait(pid_t pid, int rfd, uint64_t start_ms, uint64_t fork_us)
+{
+    uint64_t report[2] = {0, 0};
+    size_t got = 0;
+    while (got < sizeof(report))
+    {
+        ssize_t rv = read(rfd, (char *)report + got, sizeof(report) - got);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            break;
+        }
+        got += (size_t)rv;
+    }
+    close(rfd);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && got == sizeof(report);
+    save_done(ok, start_ms, report[0], fork_us, report[1]);
+}
+
+static bool save_begin()
+{
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    if (g_save.running)
+    {
+        return false;
+    }
+    g_save.running = true;
+    return true;
+}
+
+// save: writes the snapshot with all shards locked, blocking every client
+static bool snap_save()
+{
+    if (!save_begin())
+    {
+        return false;
+    }
+    uint64_t start = get_monotonic_msec();
+    lock_all_shards();
+    uint64_t bytes = snap_write();
+    unlock_all_shards();
+    save_done(bytes > 0, start, bytes, 0, 0);
+    return bytes > 0;
+}
+
+// bgsave: the shards are locked only across fork(), then the child writes
+// its copy of the data while the parent keeps serving. Pages the parent
+// modifies meanwhile are copied, which is reported as copy-on-write.
+static bool snap_bgsave()
+{
+    if (!save_begin())
+    {
+        return false;
+    }
+    int fds[2];
+    if (pipe(fds))
+    {
+        save_done(false, get_monotonic_msec(), 0, 0, 0);
+        return false;
+    }
+    uint64_t start = get_monotonic_msec();
+    lock_all_shards();
+    uint64_t t0 = get_monotonic_usec();
+    pid_t pid = fork();
+    uint64_t fork_us = get_monotonic_usec() - t0;
+    if (pid == 0)
+    {
+        close(fds[0]);
+        uint64_t report[2] = {snap_write(), 0};
+        report[1] = private_dirty_bytes();
+        bool ok = report[0] > 0 && write_full(fds[1], (char *)report, sizeof(report));
+        _exit(ok ? 0 : 1);
+    }
+    unlock_all_shards();
+    close(fds[1]);
+    if (pid < 0)
+    {
+        close(fds[0]);
+        save_done(false, start, 0, fork_us, 0);
+        return false;
+    }
+    std::thread(bgsave_wait, pid, fds[0], start, fork_us).detach();
+    return true;
+}
+
+// Decodes the value of a record into a new entry, NULL if it is
+// corrupted. The caller holds the lock of the key's shard.
+static Entry *snap_record_entry(Shard *shard, SnapReader &r, const SnapRecord &rec, uint64_t hcode)
+{
+    if (rec.type == T_STR)
+    {
+        std::string_view val = r.get_str();
+        if (!r.ok)
+        {
+            return NULL;
+        }
+        return entry_new(shard, rec.key, hcode, T_STR, val);
+    }
+
+    Entry *ent = entry_new(shard, rec.key, hcode, T_ZSET);
+    uint64_t n = r.get_varint();
+    for (uint64_t i = 0; i < n && r.ok; i++)
+    {
+        double score = r.get_f64();
+        std::string_view name = r.get_str();
+        zset_add(entry_zset(ent), name.data(), name.size(), score);
+    }
+    if (!r.ok)
+    {
+        entry_del(shard, ent);
+        return NULL;
+    }
+    return ent;
+}
+
+static bool snap_load_record(SnapReader &r)
+{
+    SnapRecord rec;
+    if (!snap_record_head(r, rec))
+    {
+        return false;
+    }
+    uint64_t now = get_realtime_msec();
+    if (rec.expire_at && rec.expire_at <= now)
+    {
+        return snap_record_skip(r, rec.type);
+    }
+
+    uint64_t hcode = str_hash((const uint8_t *)rec.key.data(), rec.key.size());
+    Shard *shard = shard_of(hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+    Entry *ent = snap_record_entry(shard, r, rec, hcode);
+    if (!ent)
+    {
+        return false;
+    }
+    entry_link(shard, ent);
+    if (rec.expire_at)
+    {
+        entry_set_ttl(shard, ent, (int64_t)(rec.expire_at - now));
+    }
+    return true;
+}
+
+// Loads the snapshot at startup, one thread per worker, each decoding
+// every nthreads-th section. Sections were written per shard but keys are
+// rehashed, so the number of threads may differ from the saving server.
+static void snap_load(uint32_t nthreads)
+{
+    SnapFile f;
+    std::string err;
+    if (access(g_save.path.c_str(), F_OK) != 0)
+    {
+        return;
+    }
+    uint64_t start = get_monotonic_msec();
+    if (!f.open(g_save.path.c_str(), err))
+    {
+        std::cerr << "snapshot " << g_save.path << ": " << err << std::endl;
+        exit(1);
+    }
+
+    std::atomic<bool> bad{false};
+    std::atomic<uint64_t> nkeys{0};
+    auto work = [&](size_t t) {
+        for (size_t i = t; i < f.sections.size() && !bad; i += nthreads)
+        {
+            const uint8_t *p = f.section(i);
+            if (!p)
+            {
+                bad = true;
+                break;
+            }
+            SnapReader r(p, f.sections[i].size);
+            for (uint64_t k = 0; k < f.sections[i].nkeys && !bad; k++)
+            {
+                bad = bad || !snap_load_record(r);
+            }
+            bad = bad || r.cur != r.end;
+            nkeys += f.sections[i].nkeys;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < nthreads; t++)
+    {
+        threads.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &th : threads)
+    {
+        th.join();
+    }
+    size_t size = f.size;
+    f.close();
+    if (bad)
+    {
+        std::cerr << "snapshot " << g_save.path << ": corrupted section" << std::endl;
+        exit(1);
+    }
+    uint64_t ms = std::max<uint64_t>(get_monotonic_msec() - start, 1);
+    std::cerr << "snapshot: loaded " << nkeys << " keys, " << size << " bytes in " << ms
+              << " ms (" << (double)size / ms / 1e6 << " GB/s)" << std::endl;
+}
+
+// Maps the snapshot for --mmap. Only the footer is checked, so startup
+// takes the same time for any size. The sections are not verified, but
+// records are still decoded with bounds checks.
+static void overlay_map()
+{
+    if (access(g_save.path.c_str(), F_OK) != 0)
+    {
+        return;
+    }
+    uint64_t start = get_monotonic_usec();
+    std::string err;
+    if (!g_overlay.file.open(g_save.path.c_str(), err))
+    {
+        std::cerr << "snapshot " << g_save.path << ": " << err << std::endl;
+        exit(1);
+    }
+    // untouched pages of an anonymous mapping are zero and cost nothing
+    size_t words = (g_overlay.file.index_slots + 63) / 64;
+    void *p = mmap(NULL, words * 8, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        die("mmap()");
+    }
+    g_overlay.dead = (uint64_t *)p;
+    g_overlay.enabled = true;
+
+    uint64_t nkeys = 0;
+    for (SnapSection &sec : g_overlay.file.sections)
+    {
+        nkeys += sec.nkeys;
+    }
+    std::cerr << "snapshot: mapped " << nkeys << " keys, " << g_overlay.file.size << " bytes in "
+              << get_monotonic_usec() - start << " us" << std::endl;
+}
+
+// Looks up a key in the mapped snapshot, and on success leaves r at the
+// value of its record. The caller holds the lock of the key's shard.
+static bool overlay_find(const HKey *key, SnapRecord &rec, SnapReader &r)
+{
+    if (!g_overlay.enabled)
+    {
+        return false;
+    }
+    uint64_t hcode = str_hash_seed(key->data, key->len, g_overlay.file.seed);
+    std::string_view name((const char *)key->data, key->len);
+    uint64_t slot = 0;
+    if (!g_overlay.file.find(hcode, name, &slot))
+    {
+        return false;
+    }
+    return overlay_record(slot, get_realtime_msec(), rec, r);
+}
+
+// Drops a key from the mapped snapshot, true if it was there
+static bool overlay_drop(const HKey *key)
+{
+    SnapRecord rec;
+    SnapReader r(NULL, 0);
+    if (!overlay_find(key, rec, r))
+    {
+        return false;
+    }
+    overlay_set_dead(rec.slot);
+    return true;
+}
+
+// Copies a key from the mapped snapshot into its shard, the caller holds
+// the shard lock
+static Entry *overlay_promote(Shard *shard, const HKey *key)
+{
+    SnapRecord rec;
+    SnapReader r(NULL, 0);
+    if (!overlay_find(key, rec, r))
+    {
+        return NULL;
+    }
+    overlay_set_dead(rec.slot);
+    Entry *ent = snap_record_entry(shard, r, rec, key->hcode);
+    if (!ent)
+    {
+        msg("snapshot: corrupted record");
+        return NULL;
+    }
+    entry_link(shard, ent);
+    if (rec.expire_at)
+    {
+        int64_t ttl = (int64_t)(rec.expire_at - get_realtime_msec());
+        entry_set_ttl(shard, ent, std::max<int64_t>(ttl, 0));
+    }
+    return ent;
+}
+
+static bool str2dbl(std::string_view s, double &out)
+{
+    std::string buf(s);
+    char *endp = NULL;
+    out = strtod(buf.c_str(), &endp);
+    return endp == buf.c_str() + buf.size() && !buf.empty() && !isnan(out);
+}
+
+static bool str2int(std::string_view s, int64_t &out)
+{
+    std::string buf(s);
+    char *endp = NULL;
+    out = strtoll(buf.c_str(), &endp, 10);
+    return endp == buf.c_str() + buf.size() && !buf.empty();
+}
+
+// The entry of a node that a lookup found, NULL if it has expired and
+// was removed
+static Entry *entry_live(Shard *shard, HNode *node)
+{
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx != (size_t)-1 && shard->heap[ent->heap_idx].val <= get_monotonic_msec())
+    {
+        aof_log_del(ent);
+        entry_unlink(shard, ent);
+        entry_free(shard, ent, false);
+        return NULL;
+    }
+    entry_touch(ent);
+    return ent;
+}
+
+// Like hm_lookup, but an expired key is removed and reported as missing,
+// and with `promote` a key still in the mapped snapshot is loaded first.
+// The caller holds the shard lock.
+static Entry *entry_lookup(Shard *shard, const HKey *key, bool promote = true)
+{
+    HNode *node = shard->db.hm_lookup(key, &entry_eq);
+    if (!node)
+    {
+        return promote ? overlay_promote(shard, key) : NULL;
+    }
+    return entry_live(shard, node);
+}
+
+// Evicts sampled keys until the shard is back within its share of
+// maxmemory. Called before a write, the caller holds the shard lock.
+static void shard_evict(Shard *shard)
+{
+    if (!g_conf.maxmemory)
+    {
+        return;
+    }
+    // keys are spread evenly by hash, so each shard gets an equal share
+    size_t limit = g_conf.maxmemory / g_data.nshards;
+    uint64_t now = get_monotonic_msec();
+    while (shard->used_memory > limit && shard->db.hm_size() > 0)
+    {
+        Entry *victim = NULL;
+        uint64_t best = 0;
+        for (size_t i = 0; i < k_evict_samples; i++)
+        {
+            Entry *ent = container_of(shard->db.hm_sample(fast_rand()), Entry, node);
+            uint64_t score = evict_score(ent, now);
+            if (!victim || score > best)
+            {
+                victim = ent;
+                best = score;
+            }
+        }
+        aof_log_del(victim);
+        entry_unlink(shard, victim);
+        entry_free(shard, victim, false);
+        shard->evicted++;
+    }
+}
+
+static void cb_scan(HNode *node, void *arg)
+{
+    std::string &out = *(std::string *)arg;
+    out_str(out, entry_key(container_of(node, Entry, node)));
+}
+
+// `ent` is what entry_lookup() returns for the key without promoting
+// it, the caller holds the shard lock
+static void get_locked(const HKey *key, Entry *ent, std::string &out)
+{
+    if (!ent)
+    {
+        // a key still in the mapped snapshot is read in place
+        SnapRecord rec;
+        SnapReader r(NULL, 0);
+        if (!overlay_find(key, rec, r))
+        {
+            return out_nil(out);
+        }
+        if (rec.type != T_STR)
+        {
+            return out_err(out, ERR_TYPE, "expect string type");
+        }
+        std::string_view val = r.get_str();
+        return r.ok ? out_str(out, val) : out_err(out, ERR_UNKNOWN, "corrupted snapshot");
+    }
+
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    char buf[k_int_len];
+    out_str(out, entry_val(ent, buf));
+}
+
+// `ent` is what entry_lookup() returns for the key without promoting it,
+// after shard_evict(). Returns the entry of the key afterwards, if it has
+// one. The caller holds the shard lock.
+static Entry *set_locked(Shard *shard, const HKey *key, Entry *ent, std::string_view name,
+                         std::string_view val, std::string &out)
+{
+    SnapRecord rec;
+    SnapReader r(NULL, 0);
+    if (!ent && overlay_find(key, rec, r))
+    {
+        // the old value in the mapped snapshot is replaced without loading it
+        if (rec.type != T_STR)
+        {
+            out_err(out, ERR_TYPE, "expect string type");
+            return NULL;
+        }
+        overlay_set_dead(rec.slot);
+    }
+
+    if (ent)
+    {
+        if (ent->type != T_STR)
+        {
+            out_err(out, ERR_TYPE, "expect string type");
+            return ent;
+        }
+        size_t before = entry_mem(ent);
+        entry_set_val(ent, val);
+        shard->used_memory += entry_mem(ent) - before;
+        // like Redis, overwriting a value discards its TTL
+        entry_set_ttl(shard, ent, -1);
+    }
+    else
+    {
+        ent = entry_new(shard, name, key->hcode, T_STR, val);
+        entry_link(shard, ent);
+    }
+
+    std::string_view args[] = {"set", name, val};
+    aof_log(args, 3);
+    out_nil(out);
+    return ent;
+}
+
+// Returns whether the key existed. `ent` is what entry_lookup() returns
+// for the key without promoting it, the caller holds the shard lock.
+static bool del_locked(Shard *shard, const HKey *key, Entry *ent, std::string_view name,
+                       bool lazy)
+{
+    bool found = ent || overlay_drop(key);
+    if (found)
+    {
+        std::string_view args[] = {"del", name};
+        aof_log(args, 2);
+    }
+    if (ent)
+    {
+        entry_unlink(shard, ent);
+        entry_free(shard, ent, lazy);
+    }
+    return found;
+}
+
+static void do_get(ReqArgs &cmd, std::string &out)
+{
+    HKey key = make_key(cmd[1]);
+
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+    get_locked(&key, entry_lookup(shard, &key, false), out);
+}
+
+static void do_set(ReqArgs &cmd, std::string &out)
+{
+    HKey key = make_key(cmd[1]);
+
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+    shard_evict(shard);
+    set_locked(shard, &key, entry_lookup(shard, &key, false), cmd[1], cmd[2], out);
+}
+
+// del key, unlink key. Both remove the key at once, unlink always
+// frees it on the lazy free thread and del only when it is large.
+static void do_del(ReqArgs &cmd, std::string &out, bool lazy)
+{
+    HKey key = make_key(cmd[1]);
+
+    Shard *shard = shard_of(key.hcode);
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        found = del_locked(shard, &key, entry_lookup(shard, &key, false), cmd[1], lazy);
+    }
+
+    out_int(out, found ? 1 : 0);
+}
+
+// Looks up keys[0, n) with hm_lookup_batch() per shard and stores the
+// node of each key, or NULL, in found[0, n). The caller holds the shards.
+static void lookup_keys(const HKey *keys, size_t n, HNode **found)
+{
+    assert(n <= k_batch_group);
+    HKey group[k_batch_group];
+    HNode *res[k_batch_group];
+    size_t idx[k_batch_group];
+    bool done[k_batch_group] = {};
+    for (size_t i = 0; i < n; i++)
+    {
+        if (done[i])
+        {
+            continue;
+        }
+        Shard *shard = shard_of(keys[i].hcode);
+        size_t m = 0;
+        for (size_t j = i; j < n; j++)
+        {
+            if (!done[j] && shard_of(keys[j].hcode) == shard)
+            {
+                group[m] = keys[j];
+                idx[m++] = j;
+                done[j] = true;
+            }
+        }
+        shard->db.hm_lookup_batch(group, m, &entry_eq, res);
+        for (size_t k = 0; k < m; k++)
+        {
+            found[idx[k]] = res[k];
+        }
+    }
+}
+
+// The keys of a multi-key command, or of a run of pipelined single-key
+// requests, hashed before any of them is looked up. Every shard they
+// fall in stays locked for the whole batch, taken in shard order like
+// lock_all_shards(), so the batch is atomic and cannot deadlock with
+// another one.
+struct KeyBatch
+{
+    std::vector<HKey> keys;
+    std::vector<bool> locked; // by shard index
+    std::vector<HNode *> found; // by key, see lookup()
+    std::vector<bool> stale;    // by key, found[i] may have been evicted
+
+    // the keys are cmd[first], cmd[first + step], ...
+    KeyBatch(ReqArgs &cmd, size_t first, size_t step)
+    {
+        keys.reserve((cmd.size() - first + step - 1) / step);
+        for (size_t i = first; i < cmd.size(); i += step)
+        {
+            keys.push_back(make_key(cmd[i]));
+        }
+        lock();
+    }
+    KeyBatch(const std::string_view *names, size_t n)
+    {
+        keys.reserve(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            keys.push_back(make_key(names[i]));
+        }
+        lock();
+    }
+    void lock()
+    {
+        locked.assign(g_data.nshards, false);
+        for (const HKey &key : keys)
+        {
+            locked[shard_of(key.hcode) - g_data.shards] = true;
+        }
+        for (uint32_t i = 0; i < g_data.nshards; i++)
+        {
+            if (locked[i])
+            {
+                g_data.shards[i].mu.lock();
+            }
+        }
+    }
+    ~KeyBatch()
+    {
+        for (uint32_t i = g_data.nshards; i-- > 0;)
+        {
+            if (locked[i])
+            {
+                g_data.shards[i].mu.unlock();
+            }
+        }
+    }
+    KeyBatch(const KeyBatch &) = delete;
+    KeyBatch &operator=(const KeyBatch &) = delete;
+
+    Shard *shard(size_t i) { return shard_of(keys[i].hcode); }
+
+    // The entry of key i, like entry_lookup(shard(i), &keys[i], false).
+    // The keys of a group of k_batch_group are looked up together when
+    // the first of them is asked for, so the keys must be asked for in
+    // order. A command that changes the map meanwhile tells the batch
+    // with evict() and update().
+    Entry *lookup(size_t i)
+    {
+        size_t end = std::min(keys.size(), i - i % k_batch_group + k_batch_group);
+        if (i % k_batch_group == 0)
+        {
+            found.resize(keys.size());
+            stale.resize(keys.size());
+            lookup_keys(&keys[i], end - i, &found[i]);
+            std::fill(stale.begin() + i, stale.begin() + end, false);
+        }
+        if (stale[i])
+        {
+            Entry *ent = entry_lookup(shard(i), &keys[i], false);
+            update(i, ent);
+            return ent;
+        }
+        HNode *node = found[i];
+        Entry *ent = node ? entry_live(shard(i), node) : NULL;
+        if (node && !ent)
+        {
+            update(i, NULL); // expired and removed
+        }
+        return ent;
+    }
+
+    // Key i has `ent` now, or no entry, for when it comes up again later
+    // in the group
+    void update(size_t i, Entry *ent)
+    {
+        for (size_t j = i + 1; j < keys.size() && j % k_batch_group != 0; j++)
+        {
+            if (keys[j].hcode == keys[i].hcode && keys[j].len == keys[i].len
+                && memcmp(keys[j].data, keys[i].data, keys[i].len) == 0)
+            {
+                found[j] = ent ? &ent->node : NULL;
+                stale[j] = false;
+            }
+        }
+    }
+
+    // Runs shard_evict() before a write of key i. The entries found for
+    // the rest of the group in that shard may be gone, so those keys are
+    // looked up again one at a time.
+    void evict(size_t i)
+    {
+        Shard *sh = shard(i);
+        size_t before = sh->evicted;
+        shard_evict(sh);
+        if (sh->evicted == before || i % k_batch_group == 0)
+        {
+            return; // nothing evicted, or the group is not looked up yet
+        }
+        for (size_t j = i; j < keys.size() && j % k_batch_group != 0; j++)
+        {
+            stale[j] = stale[j] || shard(j) == sh;
+        }
+    }
+};
+
+// mget key... Returns an array with the value, nil or error of each key
+static void do_mget(ReqArgs &cmd, std::string &out)
+{
+    KeyBatch batch(cmd, 1, 1);
+    out_arr(out, (uint32_t)batch.keys.size());
+    for (size_t i = 0; i < batch.keys.size(); i++)
+    {
+        get_locked(&batch.keys[i], batch.lookup(i), out);
+    }
+}
+
+// mset key value... Returns an array with the result of each SET. Keys
+// are set in order, so a repeated key ends with its last value.
+static void do_mset(ReqArgs &cmd, std::string &out)
+{
+    KeyBatch batch(cmd, 1, 2);
+    out_arr(out, (uint32_t)batch.keys.size());
+    for (size_t i = 0; i < batch.keys.size(); i++)
+    {
+        batch.evict(i);
+        Entry *ent = batch.lookup(i);
+        ent = set_locked(batch.shard(i), &batch.keys[i], ent, cmd[1 + 2 * i], cmd[2 + 2 * i], out);
+        batch.update(i, ent);
+    }
+}
+
+// mdel key... Returns an array of 1 or 0, whether each key was removed
+static void do_mdel(ReqArgs &cmd, std::string &out)
+{
+    KeyBatch batch(cmd, 1, 1);
+    out_arr(out, (uint32_t)batch.keys.size());
+    for (size_t i = 0; i < batch.keys.size(); i++)
+    {
+        Entry *ent = batch.lookup(i);
+        bool found = del_locked(batch.shard(i), &batch.keys[i], ent, cmd[1 + i], false);
+        if (ent)
+        {
+            batch.update(i, NULL);
+        }
+        out_int(out, found ? 1 : 0);
+    }
+}
+
+static void do_keys(ReqArgs &cmd, std::string &out)
+{
+    (void)cmd;
+    // Fan out to every shard, then merge the results into one array. The
+    // shards stay locked so that no key moves out of the mapped snapshot
+    // while it is listed.
+    uint32_t n = 0;
+    std::string keys;
+    lock_all_shards();
+    for (uint32_t i = 0; i < g_data.nshards; i++)
+    {
+        Shard *shard = &g_data.shards[i];
+        n += (uint32_t)shard->db.hm_size();
+        shard->db.ht1.h_scan(&cb_scan, &keys);
+        shard->db.ht2.h_scan(&cb_scan, &keys);
+    }
+    uint64_t now = get_realtime_msec();
+    for (uint64_t slot = 0; g_overlay.enabled && slot < g_overlay.file.index_slots; slot++)
+    {
+        SnapRecord rec;
+        SnapReader r(NULL, 0);
+        if (overlay_record(slot, now, rec, r))
+        {
+            out_str(keys, rec.key);
+            n++;
+        }
+    }
+    unlock_all_shards();
+    out_arr(out, n);
+    out.append(keys);
+}
+
+// Matches one character against the class starting after '[' in `pat`.
+// Returns the position after the closing ']'.
+static size_t glob_class(std::string_view pat, size_t i, char c, bool &matched)
+{
+    bool negate = i < pat.size() && pat[i] == '^';
+    if (negate)
+    {
+        i++;
+    }
+    matched = false;
+    for (bool first = true; i < pat.size() && (first || pat[i] != ']'); first = false)
+    {
+        char lo = pat[i];
+        if (lo == '\\' && i + 1 < pat.size())
+        {
+            lo = pat[++i];
+        }
+        char hi = lo;
+        if (i + 2 < pat.size() && pat[i + 1] == '-' && pat[i + 2] != ']')
+        {
+            hi = pat[i + 2];
+            i += 2;
+        }
+        if (lo > hi)
+        {
+            std::swap(lo, hi);
+        }
+        matched |= lo <= c && c <= hi;
+        i++;
+    }
+    matched ^= negate;
+    return i < pat.size() ? i + 1 : i;
+}
+
+// Glob style matching with *, ?, [abc], [a-z], [^a] and \ escapes. A '*'
+// remembers where it was and retries from there, so there is no recursion
+// and at most O(len(pat) * len(str)) steps.
+static bool glob_match(std::string_view pat, std::string_view str)
+{
+    size_t p = 0;
+    size_t s = 0;
+    size_t star_p = std::string_view::npos;
+    size_t star_s = 0;
+    while (s < str.size())
+    {
+        if (p < pat.size() && pat[p] == '*')
+        {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < pat.size())
+        {
+            bool ok = false;
+            size_t next = p + 1;
+            if (pat[p] == '?')
+            {
+                ok = true;
+            }
+            else if (pat[p] == '[')
+            {
+                next = glob_class(pat, p + 1, str[s], ok);
+            }
+            else if (pat[p] == '\\' && p + 1 < pat.size())
+            {
+                ok = pat[p + 1] == str[s];
+                next = p + 2;
+            }
+            else
+            {
+                ok = pat[p] == str[s];
+            }
+            if (ok)
+            {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (star_p == std::string_view::npos)
+        {
+            return false;
+        }
+        // let the last '*' take one more character
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < pat.size() && pat[p] == '*')
+    {
+        p++;
+    }
+    return p == pat.size();
+}
+
+struct ScanCtx
+{
+    Shard *shard = NULL;
+    std::string_view pattern;
+    bool match = false;
+    uint64_t now = 0;
+    std::string keys;
+    uint32_t n = 0;
+};
+
+static void cb_scan_match(HNode *node, void *arg)
+{
+    ScanCtx *ctx = (ScanCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx != (size_t)-1 && ctx->shard->heap[ent->heap_idx].val <= ctx->now)
+    {
+        return; // expired, but not removed yet
+    }
+    if (ctx->match && !glob_match(ctx->pattern, entry_key(ent)))
+    {
+        return;
+    }
+    out_str(ctx->keys, entry_key(ent));
+    ctx->n++;
+}
+
+// Reports the key of one slot of the mapped snapshot's index. The key of
+// a dead slot may have been loaded into its shard after the shard was
+// scanned, so it is looked up there.
+static void scan_overlay_slot(ScanCtx *ctx, uint64_t slot, uint64_t now)
+{
+    const uint8_t *p = g_overlay.file.slot_record(slot);
+    if (!p)
+    {
+        return;
+    }
+    SnapRecord rec;
+    SnapReader r = g_overlay.file.reader(p);
+    if (!snap_record_head(r, rec) || (ctx->match && !glob_match(ctx->pattern, rec.key)))
+    {
+        return;
+    }
+    if (overlay_dead(slot))
+    {
+        HKey key = make_key(rec.key);
+        Shard *shard = shard_of(key.hcode);
+        std::lock_guard<std::mutex> lock(shard->mu);
+        if (!entry_lookup(shard, &key, false))
+        {
+            return;
+        }
+    }
+    else if (rec.expire_at && rec.expire_at <= now)
+    {
+        return;
+    }
+    out_str(ctx->keys, rec.key);
+    ctx->n++;
+}
+
+// scan cursor [match pattern] [count n]
+// Returns [next cursor, [keys...]], the scan is complete when the next
+// cursor is 0. Each call visits about `count` keys, or 10 * count slots
+// when most of them are empty or filtered, then hands back a cursor.
+// With --mmap a key may be reported twice.
+static void do_scan(ReqArgs &cmd, std::string &out)
+{
+    std::string buf(cmd[1]);
+    char *endp = NULL;
+    uint64_t cursor = strtoull(buf.c_str(), &endp, 10);
+    if (buf.empty() || *endp)
+    {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+
+    ScanCtx ctx;
+    int64_t count = k_scan_count;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        if (cmd_is(cmd[i], "match"))
+        {
+            ctx.pattern = cmd[i + 1];
+            ctx.match = ctx.pattern != "*";
+        }
+        else if (cmd_is(cmd[i], "count"))
+        {
+            if (!str2int(cmd[i + 1], count) || count <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect positive int");
+            }
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+    }
+
+    uint64_t mask = (1ull << k_scan_shard_bits) - 1;
+    uint32_t sid = (uint32_t)(cursor & mask);
+    size_t pos = (size_t)(cursor >> k_scan_shard_bits);
+    ctx.now = get_monotonic_msec();
+    size_t budget = (size_t)count * 10;
+    while (sid < g_data.nshards && ctx.n < (size_t)count && budget > 0)
+    {
+        ctx.shard = &g_data.shards[sid];
+        std::lock_guard<std::mutex> lock(ctx.shard->mu);
+        do
+        {
+            pos = ctx.shard->db.hm_scan(pos, &cb_scan_match, &ctx);
+        } while (pos != 0 && ctx.n < (size_t)count && --budget > 0);
+        if (pos == 0)
+        {
+            sid++; // next shard from its start
+        }
+    }
+    // then the mapped snapshot, one index slot at a time
+    bool more = sid < g_data.nshards;
+    if (sid == g_data.nshards && g_overlay.enabled)
+    {
+        uint64_t now = get_realtime_msec();
+        for (; pos < g_overlay.file.index_slots && ctx.n < (size_t)count && budget > 0; pos++, budget--)
+        {
+            scan_overlay_slot(&ctx, pos, now);
+        }
+        more = pos < g_overlay.file.index_slots;
+    }
+
+    out_arr(out, 2);
+    out_int(out, more ? (int64_t)(((uint64_t)pos << k_scan_shard_bits) | sid) : 0);
+    out_arr(out, ctx.n);
+    out.append(ctx.keys);
 }
 
-static bool try_one_request(struct Conn *conn)
+// zadd zset score name
+static void do_zadd(ReqArgs &cmd, std::string &out)
 {
+    double score = 0;
+    if (!str2dbl(cmd[2], score))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
 
-    if (conn->rbuf_size < 4)
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+    shard_evict(shard);
+
+    Entry *ent = entry_lookup(shard, &key);
+    if (!ent)
     {
-        // not enough data in the buffer
+        ent = entry_new(shard, cmd[1], key.hcode, T_ZSET);
+        entry_link(shard, ent);
+    }
+    else if (ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+
+    size_t before = entry_mem(ent);
+    bool added = zset_add(entry_zset(ent), cmd[3].data(), cmd[3].size(), score);
+    shard->used_memory += entry_mem(ent) - before;
+    aof_log(&cmd[0], cmd.size());
+    out_int(out, (int64_t)added);
+}
+
+// Looks up a zset, the caller holds the shard lock. Returns false after
+// writing an error if the key holds another type. A missing key leaves
+// *ent NULL and reads as an empty set.
+static bool expect_zset(Shard *shard, HKey *key, std::string &out, Entry **ent)
+{
+    *ent = entry_lookup(shard, key);
+    if (!*ent)
+    {
+        return true;
+    }
+    if ((*ent)->type != T_ZSET)
+    {
+        out_err(out, ERR_TYPE, "expect zset");
         return false;
     }
+    return true;
+}
 
-    uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[conn->rbuf_read], 4);
+// zrem zset name
+static void do_zrem(ReqArgs &cmd, std::string &out)
+{
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
 
-    if (len > k_max_msg)
+    Entry *ent = NULL;
+    if (!expect_zset(shard, &key, out, &ent))
+    {
+        return;
+    }
+    if (!ent)
+    {
+        return out_int(out, 0);
+    }
+
+    size_t before = entry_mem(ent);
+    ZNode *znode = zset_pop(entry_zset(ent), cmd[2].data(), cmd[2].size());
+    shard->used_memory -= before - entry_mem(ent);
+    if (znode)
+    {
+        aof_log(&cmd[0], cmd.size());
+        znode_del(znode);
+    }
+    out_int(out, znode ? 1 : 0);
+}
+
+// zscore zset name
+static void do_zscore(ReqArgs &cmd, std::string &out)
+{
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    Entry *ent = NULL;
+    if (!expect_zset(shard, &key, out, &ent))
+    {
+        return;
+    }
+    ZNode *znode = ent ? zset_lookup(entry_zset(ent), cmd[2].data(), cmd[2].size()) : NULL;
+    return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+// zrank zset name
+static void do_zrank(ReqArgs &cmd, std::string &out)
+{
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    Entry *ent = NULL;
+    if (!expect_zset(shard, &key, out, &ent))
+    {
+        return;
+    }
+    ZNode *znode = ent ? zset_lookup(entry_zset(ent), cmd[2].data(), cmd[2].size()) : NULL;
+    return znode ? out_int(out, zset_rank(entry_zset(ent), znode)) : out_nil(out);
+}
+
+// zquery zset score name offset limit
+static void do_zquery(ReqArgs &cmd, std::string &out)
+{
+    double score = 0;
+    if (!str2dbl(cmd[2], score))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    int64_t offset = 0;
+    int64_t limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    Entry *ent = NULL;
+    if (!expect_zset(shard, &key, out, &ent))
+    {
+        return;
+    }
+    if (!ent || limit <= 0)
+    {
+        return out_arr(out, 0);
+    }
+
+    // seek to the key, then skip `offset` members in O(log n)
+    ZNode *znode = zset_query(entry_zset(ent), score, cmd[3].data(), cmd[3].size(), offset);
+
+    // output pairs of (name, score), counted in pairs so that any
+    // positive limit is safe
+    size_t ctx = out_begin_arr(out);
+    int64_t npairs = 0;
+    while (znode && npairs < limit)
+    {
+        out_str(out, std::string_view(znode->name, znode->len));
+        out_dbl(out, znode->score);
+        npairs++;
+        znode = znode_next(znode);
+    }
+    out_end_arr(out, ctx, (uint32_t)(npairs * 2));
+}
+
+static void expire_key(std::string_view name, int64_t ttl_ms, std::string &out)
+{
+    HKey key = make_key(name);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    Entry *ent = entry_lookup(shard, &key);
+    if (ent)
+    {
+        entry_set_ttl(shard, ent, ttl_ms);
+        // logged as a wall clock deadline, so a replay does not extend it
+        aof_log_expire(ent, expire_at_real(shard->heap[ent->heap_idx].val));
+    }
+    out_int(out, ent ? 1 : 0);
+}
+
+// expire key seconds, pexpire key milliseconds
+static void do_expire(ReqArgs &cmd, std::string &out, int64_t unit_ms)
+{
+    int64_t ttl = 0;
+    if (!str2int(cmd[2], ttl) || ttl > INT64_MAX / 2 / unit_ms)
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    // a deadline in the past expires the key on its next access
+    expire_key(cmd[1], std::max<int64_t>(ttl, 0) * unit_ms, out);
+}
+
+// pexpireat key unix-time-milliseconds
+static void do_expireat(ReqArgs &cmd, std::string &out)
+{
+    int64_t at = 0;
+    if (!str2int(cmd[2], at) || at < 0 || at > INT64_MAX / 2)
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    expire_key(cmd[1], std::max<int64_t>(at - (int64_t)get_realtime_msec(), 0), out);
+}
+
+// save, bgsave
+static void do_save(ReqArgs &cmd, std::string &out, bool bg)
+{
+    (void)cmd;
+    if (!(bg ? snap_bgsave() : snap_save()))
+    {
+        return out_err(out, ERR_ARG, "save in progress or failed");
+    }
+    out_str(out, bg ? "background save started" : "saved");
+}
+
+// memory stats
+// Returns name, value pairs: the process RSS, the accounted memory, and
+// for each slab size class in use its chunk size, chunks in use and
+// chunks carved, summed over the shards.
+static void do_memory(ReqArgs &cmd, std::string &out)
+{
+    (void)cmd;
+    size_t used = 0;
+    size_t pages = 0;
+    size_t large = 0;
+    SlabClass classes[k_slab_nclass];
+    for (uint32_t i = 0; i < g_data.nshards; i++)
+    {
+        Shard *shard = &g_data.shards[i];
+        std::lock_guard<std::mutex> lock(shard->mu);
+        used += shard->used_memory;
+        pages += shard->slab.pages.size();
+        large += shard->slab.large;
+        for (size_t c = 0; c < k_slab_nclass; c++)
+        {
+            classes[c].size = shard->slab.classes[c].size;
+            classes[c].used += shard->slab.classes[c].used;
+            classes[c].total += shard->slab.classes[c].total;
+        }
+    }
+    uint64_t rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        uint64_t vsz = 0;
+        if (fscanf(fp, "%lu %lu", &vsz, &rss) != 2)
+        {
+            rss = 0;
+        }
+        fclose(fp);
+        rss *= (uint64_t)sysconf(_SC_PAGESIZE);
+    }
+
+    std::string body;
+    uint32_t n = 0;
+    auto add = [&](const std::string &name, int64_t val) {
+        out_str(body, name);
+        out_int(body, val);
+        n += 2;
+    };
+    add("rss", (int64_t)rss);
+    add("used_memory", (int64_t)used);
+    add("slab.pages", (int64_t)pages);
+    add("slab.page_bytes", (int64_t)(pages * k_slab_page));
+    add("slab.large_bytes", (int64_t)large);
+    for (SlabClass &sc : classes)
+    {
+        if (sc.total > 0)
+        {
+            std::string prefix = "slab." + std::to_string(sc.size);
+            add(prefix + ".used", (int64_t)sc.used);
+            add(prefix + ".chunks", (int64_t)sc.total);
+        }
+    }
+    out_arr(out, n);
+    out.append(body);
+}
+
+// info
+// Returns name, value pairs: event loop metrics summed over the workers,
+// the size and resizing progress of each shard's map, then for each
+// command that was called its call count, total time and latency
+// percentiles in nanoseconds.
+static void do_info(ReqArgs &cmd, std::string &out)
+{
+    (void)cmd;
+    double per_ns = tsc_per_ns();
+    uint64_t poll_ticks = 0, wakeups = 0, bytes_read = 0, bytes_written = 0;
+    uint64_t conns = 0, accepted = 0, requests = 0, trace_dropped = 0;
+    for (uint32_t i = 0; i < g_workers.nworkers; i++)
+    {
+        WorkerStats *st = g_workers.workers[i].stats;
+        for (Histogram &h : st->latency)
+        {
+            requests += h.count.load(std::memory_order_relaxed);
+        }
+        poll_ticks += st->poll_ticks.load(std::memory_order_relaxed);
+        wakeups += st->wakeups.load(std::memory_order_relaxed);
+        bytes_read += st->bytes_read.load(std::memory_order_relaxed);
+        bytes_written += st->bytes_written.load(std::memory_order_relaxed);
+        conns += st->conns.load(std::memory_order_relaxed);
+        accepted += st->accepted.load(std::memory_order_relaxed);
+        trace_dropped += g_workers.workers[i].trace->dropped.load(std::memory_order_relaxed);
+    }
+
+    std::string body;
+    uint32_t n = 0;
+    auto add = [&](const std::string &name, int64_t val) {
+        out_str(body, name);
+        out_int(body, val);
+        n += 2;
+    };
+    auto ns = [&](uint64_t ticks) { return (int64_t)((double)ticks / per_ns); };
+
+    add("workers", g_workers.nworkers);
+    add("loop.poll_usec", ns(poll_ticks) / 1000);
+    add("loop.wakeups", (int64_t)wakeups);
+    out_str(body, "loop.requests_per_wakeup");
+    out_dbl(body, wakeups ? (double)requests / (double)wakeups : 0);
+    n += 2;
+    add("loop.requests", (int64_t)requests);
+    add("loop.bytes_read", (int64_t)bytes_read);
+    add("loop.bytes_written", (int64_t)bytes_written);
+    add("loop.connections", (int64_t)conns);
+    add("loop.connections_accepted", (int64_t)accepted);
+    add("trace.enabled", g_trace.enabled.load(std::memory_order_relaxed) ? 1 : 0);
+    add("trace.dropped", (int64_t)trace_dropped);
+
+    // a shard's map is resizing while its old table is drained into the new
+    size_t keys = 0;
+    for (uint32_t i = 0; i < g_data.nshards; i++)
+    {
+        Shard *shard = &g_data.shards[i];
+        std::lock_guard<std::mutex> lock(shard->mu);
+        HMap &db = shard->db;
+        keys += db.hm_size();
+        std::string prefix = "shard." + std::to_string(i);
+        add(prefix + ".keys", (int64_t)db.hm_size());
+        add(prefix + ".slots", (int64_t)(db.ht1.slots + db.ht2.slots));
+        add(prefix + ".resizing", db.ht2.tab ? 1 : 0);
+        if (db.ht2.tab)
+        {
+            add(prefix + ".resizing_pos", (int64_t)db.resizing_pos);
+            add(prefix + ".resizing_slots", (int64_t)db.ht2.slots);
+        }
+    }
+    add("keys", (int64_t)keys);
+
+    for (uint32_t id = 0; id < CMD_COUNT; id++)
+    {
+        Histogram h;
+        for (uint32_t i = 0; i < g_workers.nworkers; i++)
+        {
+            h.merge(g_workers.workers[i].stats->latency[id]);
+        }
+        uint64_t calls = h.count.load(std::memory_order_relaxed);
+        if (calls == 0)
+        {
+            continue;
+        }
+        std::string prefix = std::string("cmd.") + k_cmd_names[id];
+        add(prefix + ".calls", (int64_t)calls);
+        add(prefix + ".usec", ns(h.sum.load(std::memory_order_relaxed)) / 1000);
+        add(prefix + ".p50_ns", ns(h.percentile(0.5)));
+        add(prefix + ".p99_ns", ns(h.percentile(0.99)));
+        add(prefix + ".p999_ns", ns(h.percentile(0.999)));
+        add(prefix + ".max_ns", ns(h.max.load(std::memory_order_relaxed)));
+    }
+
+    out_arr(out, n);
+    out.append(body);
+}
+
+// Sets the slow log threshold, after tsc_init()
+static void slowlog_set_threshold(int64_t usec)
+{
+    g_slowlog.threshold_us = usec;
+    uint64_t ticks = UINT64_MAX;
+    if (usec >= 0)
+    {
+        ticks = (uint64_t)((double)usec * 1000 * tsc_per_ns());
+    }
+    g_slowlog.threshold_ticks.store(ticks, std::memory_order_relaxed);
+}
+
+// Called for commands over the slow log threshold
+static void slowlog_add(ReqArgs &cmd, uint64_t ticks, Conn *conn)
+{
+    SlowEntry ent;
+    ent.time_ms = get_realtime_msec();
+    ent.usec = (uint64_t)((double)ticks / tsc_per_ns() / 1000);
+    ent.fd = conn->fd;
+    // like Redis, long argument lists and values are cut
+    for (size_t i = 0; i < cmd.size() && i < k_slowlog_args; i++)
+    {
+        if (i + 1 == k_slowlog_args && cmd.size() > k_slowlog_args)
+        {
+            ent.args.push_back("... (" + std::to_string(cmd.size() - i) + " more arguments)");
+            break;
+        }
+        std::string_view arg = cmd[i];
+        if (arg.size() > k_slowlog_arg_len)
+        {
+            ent.args.emplace_back(arg.substr(0, k_slowlog_arg_len));
+            ent.args.back() += "... (" + std::to_string(arg.size() - k_slowlog_arg_len) + " more bytes)";
+        }
+        else
+        {
+            ent.args.emplace_back(arg);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    ent.id = g_slowlog.next_id++;
+    g_slowlog.entries.push_front(std::move(ent));
+    while (g_slowlog.entries.size() > g_slowlog.max_len)
+    {
+        g_slowlog.entries.pop_back();
+    }
+}
+
+static void trace_add(ReqArgs &cmd, uint64_t ticks, Conn *conn)
+{
+    TraceRecord rec;
+    rec.time_us = get_realtime_usec();
+    rec.ticks = ticks;
+    rec.worker = t_worker->id;
+    rec.fd = conn->fd;
+    rec.set_args(&cmd[0], cmd.size());
+    t_worker->trace->push(rec);
+}
+
+// Writes the trace records to the trace file. The file is opened when
+// there is something to write and closed once tracing is off.
+static void trace_drain_loop()
+{
+    FILE *fp = NULL;
+    std::string buf;
+    TraceRecord rec;
+    while (true)
+    {
+        bool on = g_trace.enabled.load(std::memory_order_relaxed);
+        usleep(on ? k_trace_drain_us : 100 * k_trace_drain_us);
+
+        buf.clear();
+        double per_ns = tsc_per_ns();
+        for (uint32_t i = 0; i < g_workers.nworkers; i++)
+        {
+            while (g_workers.workers[i].trace->pop(&rec))
+            {
+                trace_format(rec, per_ns, buf);
+            }
+        }
+        if (!buf.empty() && !fp)
+        {
+            fp = fopen(g_trace.path.c_str(), "a");
+            if (!fp)
+            {
+                msg("fopen() trace");
+            }
+        }
+        if (!buf.empty() && fp)
+        {
+            if (fwrite(buf.data(), 1, buf.size(), fp) != buf.size() || fflush(fp))
+            {
+                msg("fwrite() trace");
+            }
+        }
+        if (!on && buf.empty() && fp)
+        {
+            fclose(fp);
+            fp = NULL;
+        }
+    }
+}
+
+// slowlog get [count] | slowlog len | slowlog reset
+// An entry is an array of its id, wall clock time in milliseconds,
+// duration in microseconds, client fd and the array of arguments.
+static void do_slowlog(ReqArgs &cmd, std::string &out)
+{
+    std::lock_guard<std::mutex> lock(g_slowlog.mu);
+    if (cmd.size() == 2 && cmd_is(cmd[1], "len"))
+    {
+        return out_int(out, (int64_t)g_slowlog.entries.size());
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "reset"))
+    {
+        g_slowlog.entries.clear();
+        return out_str(out, "OK");
+    }
+    int64_t count = 10;
+    if (!cmd_is(cmd[1], "get") || cmd.size() > 3 || (cmd.size() == 3 && (!str2int(cmd[2], count) || count < 0)))
+    {
+        return out_err(out, ERR_ARG, "expect slowlog get [count] | len | reset");
+    }
+    size_t n = std::min((size_t)count, g_slowlog.entries.size());
+    out_arr(out, (uint32_t)n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const SlowEntry &ent = g_slowlog.entries[i];
+        out_arr(out, 5);
+        out_int(out, (int64_t)ent.id);
+        out_int(out, (int64_t)ent.time_ms);
+        out_int(out, (int64_t)ent.usec);
+        out_int(out, ent.fd);
+        out_arr(out, (uint32_t)ent.args.size());
+        for (const std::string &arg : ent.args)
+        {
+            out_str(out, arg);
+        }
+    }
+}
+
+// trace on | trace off
+static void do_trace(ReqArgs &cmd, std::string &out)
+{
+    bool on = cmd_is(cmd[1], "on");
+    if (!on && !cmd_is(cmd[1], "off"))
+    {
+        return out_err(out, ERR_ARG, "expect trace on | off");
+    }
+    g_trace.enabled.store(on, std::memory_order_relaxed);
+    out_str(out, "OK");
+}
+
+// bgrewriteaof
+static void do_bgrewriteaof(ReqArgs &cmd, std::string &out)
+{
+    (void)cmd;
+    if (!g_aof.enabled)
+    {
+        return out_err(out, ERR_ARG, "aof is disabled");
+    }
+    if (!aof_rewrite_start())
+    {
+        return out_err(out, ERR_ARG, "rewrite in progress or fork() failed");
+    }
+    out_str(out, "rewrite started");
+}
+
+// ttl key, pttl key
+static void do_ttl(ReqArgs &cmd, std::string &out, int64_t unit_ms)
+{
+    HKey key = make_key(cmd[1]);
+    Shard *shard = shard_of(key.hcode);
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    Entry *ent = entry_lookup(shard, &key);
+    if (!ent)
+    {
+        return out_int(out, -2);
+    }
+    if (ent->heap_idx == (size_t)-1)
+    {
+        return out_int(out, -1);
+    }
+
+    uint64_t expire_at = shard->heap[ent->heap_idx].val;
+    uint64_t now = get_monotonic_msec();
+    int64_t ms = expire_at > now ? (int64_t)(expire_at - now) : 0;
+    out_int(out, (ms + unit_ms / 2) / unit_ms);
+}
+
+// Runs a command, returns its CMD_* for the stats
+static uint32_t do_command(ReqArgs &cmd, std::string &out)
+{
+    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    {
+        do_keys(cmd, out);
+        return CMD_KEYS;
+    }
+    else if (cmd.size() >= 2 && cmd.size() % 2 == 0 && cmd_is(cmd[0], "scan"))
+    {
+        do_scan(cmd, out);
+        return CMD_SCAN;
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    {
+        do_get(cmd, out);
+        return CMD_GET;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    {
+        do_set(cmd, out);
+        return CMD_SET;
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    {
+        do_del(cmd, out, false);
+        return CMD_DEL;
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "unlink"))
+    {
+        do_del(cmd, out, true);
+        return CMD_UNLINK;
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "mget"))
+    {
+        do_mget(cmd, out);
+        return CMD_MGET;
+    }
+    else if (cmd.size() >= 3 && cmd.size() % 2 == 1 && cmd_is(cmd[0], "mset"))
+    {
+        do_mset(cmd, out);
+        return CMD_MSET;
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "mdel"))
+    {
+        do_mdel(cmd, out);
+        return CMD_MDEL;
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd"))
+    {
+        do_zadd(cmd, out);
+        return CMD_ZADD;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    {
+        do_zrem(cmd, out);
+        return CMD_ZREM;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    {
+        do_zscore(cmd, out);
+        return CMD_ZSCORE;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrank"))
+    {
+        do_zrank(cmd, out);
+        return CMD_ZRANK;
+    }
+    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    {
+        do_zquery(cmd, out);
+        return CMD_ZQUERY;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "expire"))
+    {
+        do_expire(cmd, out, 1000);
+        return CMD_EXPIRE;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire"))
+    {
+        do_expire(cmd, out, 1);
+        return CMD_PEXPIRE;
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "ttl"))
+    {
+        do_ttl(cmd, out, 1000);
+        return CMD_TTL;
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl"))
+    {
+        do_ttl(cmd, out, 1);
+        return CMD_PTTL;
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpireat"))
+    {
+        do_expireat(cmd, out);
+        return CMD_PEXPIREAT;
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "save"))
     {
-        msg("too long");
-        conn->state = STATE_END;
-        return false;
+        do_save(cmd, out, false);
+        return CMD_SAVE;
     }
-
-    if (len + 4 > conn->rbuf_size)
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgsave"))
     {
-        // not enough data .. buffer will retry in the next iteration
-        return false;
+        do_save(cmd, out, true);
+        return CMD_BGSAVE;
     }
-
-    assert(conn->rbuf_read + 4 + len < sizeof(conn->rbuf));
-
-    std::cout << "client says: ";
-    print_string(&conn->rbuf[conn->rbuf_read], len + 4);
-
-    // Parse the request
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4 + conn->rbuf_read], len, cmd))
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgrewriteaof"))
     {
-        msg("bad req");
-        conn->state = STATE_END;
-        return false;
+        do_bgrewriteaof(cmd, out);
+        return CMD_BGREWRITEAOF;
     }
-
-    // Generate a response
-    std::string out;
-    do_request(cmd, out);
-
-    // Put response into the buffer
-    if (4 + out.size() > k_max_msg)
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "memory") && cmd_is(cmd[1], "stats"))
     {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+        do_memory(cmd, out);
+        return CMD_MEMORY;
     }
-
-    // Got one request , now generate the response
-    uint32_t rescode = 0;
-    uint32_t wlen = 0;
-
-    wlen += (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
-
-    // generating echoing response
-    // memcpy(&conn->wbuf, &len, sizeof(len));
-    // memcpy(&conn->wbuf[4], &conn->rbuf[4 + conn->rbuf_read], len);
-    // conn->wbuf_size += (4 + len);
-
-    // Move the buffer pointers to begin of next req
-    size_t remain = conn->rbuf_size - 4 - len;
-    conn->rbuf_read += (4 + len);
-    conn->rbuf_size = remain;
-
-    conn->state = STATE_RES;
-    state_res(conn);
-
-    return (conn->state == STATE_REQ);
-}
-
-static bool cmd_is(const std::string &req, const char *cmd)
-{
-    return strcasecmp(req.c_str(), cmd) == 0;
-}
-
-static int32_t parse_req(const uint8_t *data, uint32_t len, std::vector<std::string> &cmd)
-{
-    if (len < 4)
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "info"))
     {
-        return -1;
+        do_info(cmd, out);
+        return CMD_INFO;
     }
-
-    uint32_t n = 0;
-    memcpy(&n, &data[0], 4);
-    if (n > k_max_args)
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "slowlog"))
     {
-        return -1;
+        do_slowlog(cmd, out);
+        return CMD_SLOWLOG;
     }
-    size_t pos = 4;
-    while (n--)
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "trace"))
     {
-        if (pos + 4 > len)
-        {
-            return -1;
-        }
-        uint32_t sz = 0;
-        memcpy(&sz, &data[pos], 4);
-        if (pos + 4 + sz > len)
-        {
-            return -1;
-        }
-        cmd.push_back(std::string((char *)&data[pos + 4], sz));
-        pos += 4 + sz;
+        do_trace(cmd, out);
+        return CMD_TRACE;
     }
-
-    if (pos != len)
+    else
     {
-        return -1; // Trailing garbage
+        // command is not recognised
+        out_err(out, ERR_UNKNOWN, "Unknown command");
+        return CMD_UNKNOWN;
     }
-    return 0;
-}
-
-static bool entry_eq(HNode *lhs, HNode *rhs)
-{
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return lhs->hcode == rhs->hcode && le->key == re->key;
-}
-
-static void cb_scan(HNode *node, void *arg)
-{
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
 }
 
-static void do_get(std::vector<std::string> &cmd, std::string &out)
+// `conn` is NULL for commands replayed from the log, they are not counted
+static void do_request(ReqArgs &cmd, std::string &out, Conn *conn)
 {
-    struct Entry key;
-    swap(key.key, cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.length());
-
-    HNode *node = g_data.db.hm_lookup(&(key.node), &entry_eq);
-    if (!node)
+    if (!conn)
     {
-        return out_nil(out);
+        do_command(cmd, out);
+        return;
     }
-
-    std::string &val = container_of(node, Entry, node)->val;
-    out_str(out, val);
+    uint64_t start = tsc_now();
+    uint32_t id = do_command(cmd, out);
+    request_done(cmd, id, tsc_now() - start, conn);
 }
 
-static void do_set(std::vector<std::string> &cmd, std::string &out)
+// Records the latency of a request, and logs it if it is slow or traced
+static void request_done(ReqArgs &cmd, uint32_t id, uint64_t ticks, Conn *conn)
 {
-    struct Entry key;
-    swap(key.key, cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.length());
-
-    HNode *nd = g_data.db.hm_lookup(&(key.node), &entry_eq);
-
-    if (nd)
+    t_worker->stats->latency[id].record(ticks);
+    // one compare each when neither is wanted
+    if (ticks >= g_slowlog.threshold_ticks.load(std::memory_order_relaxed))
     {
-        swap(container_of(nd, Entry, node)->val, cmd[2]);
+        slowlog_add(cmd, ticks, conn);
     }
-    else
+    if (g_trace.enabled.load(std::memory_order_relaxed))
     {
-        struct Entry *entry = new Entry();
-        swap(entry->key, key.key);
-        swap(entry->val, cmd[2]);
-        entry->node.hcode = key.node.hcode;
-
-        g_data.db.hm_insert(&(entry->node));
+        trace_add(cmd, ticks, conn);
     }
-
-    out_nil(out);
 }
 
-static void do_del(std::vector<std::string> &cmd, std::string &out)
+// The id of a single-key request that try_key_batch() runs, CMD_COUNT
+// for any other
+static uint32_t batch_cmd(ReqArgs &cmd)
 {
-    struct Entry key;
-    swap(key.key, cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.length());
-
-    HNode *node = g_data.db.hm_pop(&(key.node), &entry_eq);
-
-    if (node)
+    if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
     {
-        delete container_of(node, struct Entry, node);
+        return CMD_GET;
     }
-
-    out_int(out, node ? 1 : 0);
-}
-
-static void do_keys(std::vector<std::string> &cmd, std::string &out)
-{
-    (void)cmd;
-    out_arr(out, (uint32_t)g_data.db.hm_size());
-    g_data.db.ht1.h_scan(&cb_scan, &out);
-    g_data.db.ht2.h_scan(&cb_scan, &out);
+    if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    {
+        return CMD_SET;
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    {
+        return CMD_DEL;
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[0], "unlink"))
+    {
+        return CMD_UNLINK;
+    }
+    return CMD_COUNT;
 }
 
-static void do_request(std::vector<std::string> &cmd, std::string &out)
+// Runs the next pipelined requests, up to k_batch_group of them, as one
+// batch while they are GET, SET, DEL or UNLINK. Like the multi-key
+// commands, their shards are locked once and their keys looked up
+// together, then they run in order and each gets its own response.
+// Returns the bytes consumed, 0 if fewer than two such requests are
+// next, which are left to try_one_request().
+static size_t try_key_batch(Conn *conn, const uint8_t *data, size_t size)
 {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    uint32_t ids[k_batch_group];
+    std::string_view args[k_batch_group][3];
+    std::string_view keys[k_batch_group];
+    size_t n = 0;
+    size_t pos = 0;
+    while (n < k_batch_group && size - pos >= 4)
     {
-        do_keys(cmd, out);
-    }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
-    {
-        do_get(cmd, out);
+        uint32_t len = 0;
+        memcpy(&len, &data[pos], 4);
+        if (len > k_max_msg || 4 + (size_t)len > size - pos)
+        {
+            break;
+        }
+        ReqArgs cmd;
+        if (parse_req(&data[pos + 4], len, cmd) != 0)
+        {
+            break;
+        }
+        ids[n] = batch_cmd(cmd);
+        if (ids[n] == CMD_COUNT)
+        {
+            break;
+        }
+        for (size_t i = 0; i < cmd.size(); i++)
+        {
+            args[n][i] = cmd[i];
+        }
+        keys[n++] = cmd[1];
+        pos += 4 + (size_t)len;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    if (n < 2)
     {
-        do_set(cmd, out);
+        return 0;
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+
+    uint64_t start = tsc_now();
     {
-        do_del(cmd, out);
+        KeyBatch batch(keys, n);
+        std::string &out = conn->wbuf;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t header = out.size();
+            out.append(4, '\0');
+            if (ids[i] == CMD_GET)
+            {
+                get_locked(&batch.keys[i], batch.lookup(i), out);
+            }
+            else if (ids[i] == CMD_SET)
+            {
+                batch.evict(i);
+                Entry *ent = batch.lookup(i);
+                ent = set_locked(batch.shard(i), &batch.keys[i], ent, keys[i], args[i][2], out);
+                batch.update(i, ent);
+            }
+            else
+            {
+                Entry *ent = batch.lookup(i);
+                bool found = del_locked(batch.shard(i), &batch.keys[i], ent, keys[i],
+                                        ids[i] == CMD_UNLINK);
+                if (ent)
+                {
+                    batch.update(i, NULL);
+                }
+                out_int(out, found ? 1 : 0);
+            }
+            end_response(conn, header);
+        }
     }
-    else
+    // the batch is timed as a whole and shared out evenly
+    uint64_t ticks = (tsc_now() - start) / n;
+    for (size_t i = 0; i < n; i++)
     {
-        // command is not recognised
-        out_err(out, ERR_UNKNOWN, "Unknown command");
+        ReqArgs cmd;
+        for (size_t j = 0; j < (ids[i] == CMD_SET ? 3 : 2); j++)
+        {
+            cmd.push_back(args[i][j]);
+        }
+        request_done(cmd, ids[i], ticks, conn);
     }
+    return pos;
 }
 
 static void state_res(Conn *conn)
@@ -565,8 +3739,8 @@ static bool try_flush_buffer(struct Conn *conn)
     int32_t rv = 0;
     do
     {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        size_t remain = conn->wbuf.size() - conn->wbuf_sent;
+        rv = send(conn->fd, &conn->wbuf[conn->wbuf_sent], remain, MSG_NOSIGNAL);
     } while (rv < 0 && errno == EINTR);
 
     if (rv < 0 && errno == EAGAIN)
@@ -580,12 +3754,19 @@ static bool try_flush_buffer(struct Conn *conn)
         return false;
     }
 
+    stat_add(t_worker->stats->bytes_written, (uint64_t)rv);
+    conn_touch(conn);
     conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size)
+    assert(conn->wbuf_sent <= conn->wbuf.size());
+    if (conn->wbuf_sent == conn->wbuf.size())
     {
         // All of buffer data written , now go back
-        conn->wbuf_size = 0;
+        conn->wbuf.clear();
+        if (conn->wbuf.capacity() > k_wbuf_keep)
+        {
+            // Give back the memory of a large reply
+            std::string().swap(conn->wbuf);
+        }
         conn->wbuf_sent = 0;
         conn->state = STATE_REQ;
         return false;
@@ -600,7 +3781,7 @@ static void out_nil(std::string &out)
     out.push_back(SER_NIL);
 }
 
-static void out_str(std::string &out, const std::string &val)
+static void out_str(std::string &out, std::string_view val)
 {
     out.push_back(SER_STR);
     uint32_t len = (uint32_t)val.length();
@@ -614,6 +3795,12 @@ static void out_int(std::string &out, int64_t val)
     out.append((char *)&val, 8);
 }
 
+static void out_dbl(std::string &out, double val)
+{
+    out.push_back(SER_DBL);
+    out.append((char *)&val, 8);
+}
+
 static void out_err(std::string &out, int32_t code, const std::string &msg)
 {
     out.push_back(SER_ERR);
@@ -629,6 +3816,20 @@ static void out_arr(std::string &out, uint32_t n)
     out.append((char *)&n, 4);
 }
 
+// For arrays whose length is only known at the end, see out_end_arr()
+static size_t out_begin_arr(std::string &out)
+{
+    out.push_back(SER_ARR);
+    out.append("\0\0\0\0", 4); // filled in later
+    return out.size() - 4;
+}
+
+static void out_end_arr(std::string &out, size_t ctx, uint32_t n)
+{
+    assert(out[ctx - 1] == SER_ARR);
+    memcpy(&out[ctx], &n, 4);
+}
+
 static void connection_io(Conn *conn)
 {
     if (conn->state == STATE_REQ)
@@ -646,7 +3847,7 @@ static void connection_io(Conn *conn)
     }
 }
 
-int main()
+static int listen_socket()
 {
     int fd;
     fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -657,6 +3858,8 @@ int main()
 
     int val = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // Every worker binds its own listener, the kernel spreads connections
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
 
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
@@ -676,64 +3879,319 @@ int main()
         die("listen()");
     }
 
-    // A map of all client connections keyed by fd
-    std::vector<Conn *> fd2conn;
-
     // Set the listen fd to non-blocking
     fd_set_nb(fd);
+    return fd;
+}
+
+static void worker_init(Worker *w)
+{
+    w->fd = listen_socket();
+    w->epfd = epoll_create1(0);
+    if (w->epfd < 0)
+    {
+        die("epoll_create1()");
+    }
+    dlist_init(&w->idle_list);
+    w->wakefd = eventfd(0, EFD_NONBLOCK);
+    if (w->wakefd < 0)
+    {
+        die("eventfd()");
+    }
+
+    int fds[] = {w->fd, w->wakefd};
+    for (int fd : fds)
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev))
+        {
+            die("epoll_ctl()");
+        }
+    }
+}
+
+// Milliseconds until the next idle connection or key of the worker's
+// shard expires, -1 for none
+static int32_t next_timer_ms(Worker *w)
+{
+    uint64_t next = (uint64_t)-1;
+
+    // idle timers, only the least recently active connection matters
+    if (g_conf.idle_timeout_ms && !dlist_empty(&w->idle_list))
+    {
+        Conn *conn = container_of(w->idle_list.next, Conn, idle_list);
+        next = conn->idle_start + g_conf.idle_timeout_ms;
+    }
+
+    // TTL timers
+    Shard *shard = &g_data.shards[w->id];
+    {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        if (!shard->heap.empty() && shard->heap[0].val < next)
+        {
+            next = shard->heap[0].val;
+        }
+    }
+
+    if (next == (uint64_t)-1)
+    {
+        return -1;
+    }
+    uint64_t now = get_monotonic_msec();
+    return next <= now ? 0 : (int32_t)std::min<uint64_t>(next - now, INT32_MAX);
+}
+
+static void process_timers(Worker *w)
+{
+    uint64_t now = get_monotonic_msec();
+
+    // idle timers, stops at the first connection that is still active.
+    // A connection is idle when neither a read nor a write made progress
+    // within the timeout, and the client did not consume any of the
+    // output queued in the kernel either: only a stalled reader is reaped.
+    while (g_conf.idle_timeout_ms && !dlist_empty(&w->idle_list))
+    {
+        Conn *conn = container_of(w->idle_list.next, Conn, idle_list);
+        if (conn->idle_start + g_conf.idle_timeout_ms > now)
+        {
+            break;
+        }
+        if (conn_draining(conn))
+        {
+            conn_touch(conn);
+            continue;
+        }
+        conn_done(w, conn);
+    }
+
+    // TTL timers
+    Shard *shard = &g_data.shards[w->id];
+    std::lock_guard<std::mutex> lock(shard->mu);
+
+    // Bounded, the rest is picked up by the next iteration with a zero timeout
+    size_t nworks = 0;
+    while (!shard->heap.empty() && shard->heap[0].val <= now && nworks++ < k_max_works)
+    {
+        Entry *ent = container_of(shard->heap[0].ref, Entry, heap_idx);
+        aof_log_del(ent);
+        entry_unlink(shard, ent);
+        entry_free(shard, ent, false);
+    }
+}
+
+static void worker_loop(Worker *w)
+{
+    t_worker = w;
 
     // Event loop
-    std::vector<struct pollfd> poll_args;
+    std::vector<struct epoll_event> events(k_max_events);
     while (true)
     {
-        poll_args.clear();
-        struct pollfd pfd = {fd, POLLIN, 0}; // Put listening fd in first position
-        poll_args.push_back(pfd);
-
-        for (Conn *conn : fd2conn) // Connection fds
+        // Wait for ready fds only, the cost is independent of idle connections.
+        // The timeout is the next key expiry.
+        int timeout = next_timer_ms(w);
+        uint64_t poll_start = tsc_now();
+        int rv = epoll_wait(w->epfd, events.data(), (int)events.size(), timeout);
+        stat_add(w->stats->poll_ticks, tsc_now() - poll_start);
+        if (rv < 0)
         {
-            if (!conn)
+            if (errno == EINTR)
             {
                 continue;
             }
-
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            pfd.events = pfd.events | POLLERR;
-            poll_args.push_back(pfd);
+            die("epoll_wait");
         }
-
-        // Poll for active fds
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), 1000);
-        if (rv < 0)
+        if (rv > 0)
         {
-            die("poll");
+            stat_add(w->stats->wakeups, 1);
         }
 
-        //
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        for (int i = 0; i < rv; ++i)
         {
-            if (poll_args[i].revents)
+            int ready = events[i].data.fd;
+            if (ready == w->fd)
             {
-                Conn *conn = fd2conn[poll_args[i].fd];
-                connection_io(conn);
-                if (conn->state == STATE_END)
-                {
-                    // client closed normally, or something bad happened.
-                    // destroy this connection
-                    fd2conn[conn->fd] = NULL;
-                    (void)close(conn->fd);
-                    free(conn);
-                }
+                // Drain the accept queue
+                while (accept_new_conn(w) == 0)
+                    ;
+                continue;
+            }
+            if (ready == w->wakefd)
+            {
+                uint64_t cnt = 0;
+                (void)!read(w->wakefd, &cnt, sizeof(cnt));
+                continue;
+            }
+
+            Conn *conn = w->fd2conn[ready];
+            if (!conn)
+            {
+                continue;
+            }
+
+            // reads and writes that make progress restart its idle timer
+            connection_io(conn);
+            if (conn->state == STATE_END)
+            {
+                // client closed normally, or something bad happened.
+                // destroy this connection
+                conn_done(w, conn);
+            }
+            else
+            {
+                conn_watch(w->epfd, conn);
             }
         }
 
-        if (poll_args[0].revents)
+        process_timers(w);
+        // one write, and with appendfsync always one fsync, per iteration
+        aof_flush();
+    }
+}
+
+// Bytes with an optional k, m or g suffix
+static uint64_t parse_bytes(const char *s)
+{
+    char *endp = NULL;
+    uint64_t n = strtoull(s, &endp, 10);
+    switch (tolower(*endp))
+    {
+    case 'g':
+        n <<= 10;
+        // fallthrough
+    case 'm':
+        n <<= 10;
+        // fallthrough
+    case 'k':
+        n <<= 10;
+    }
+    return n;
+}
+
+static void parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            g_conf.nthreads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (arg == "--idle-timeout" && i + 1 < argc)
+        {
+            g_conf.idle_timeout_ms = strtoull(argv[++i], NULL, 10) * 1000;
+        }
+        else if (arg == "--maxmemory" && i + 1 < argc)
+        {
+            g_conf.maxmemory = parse_bytes(argv[++i]);
+        }
+        else if (arg == "--slowlog-usec" && i + 1 < argc)
+        {
+            g_slowlog.threshold_us = strtoll(argv[++i], NULL, 10);
+        }
+        else if (arg == "--slowlog-max-len" && i + 1 < argc)
+        {
+            g_slowlog.max_len = strtoul(argv[++i], NULL, 10);
+        }
+        else if (arg == "--trace-file" && i + 1 < argc)
+        {
+            g_trace.path = argv[++i];
+        }
+        else if (arg == "--mmap")
+        {
+            g_conf.mmap_snapshot = true;
+        }
+        else if (arg == "--dbfilename" && i + 1 < argc)
         {
-            (void)accept_new_conn(fd2conn, fd);
+            g_save.path = argv[++i];
         }
+        else if (arg == "--appendonly" && i + 1 < argc)
+        {
+            g_aof.path = argv[++i];
+        }
+        else if (arg == "--appendfsync" && i + 1 < argc
+                 && (std::string(argv[i + 1]) == "always" || std::string(argv[i + 1]) == "everysec"
+                     || std::string(argv[i + 1]) == "no"))
+        {
+            std::string policy = argv[++i];
+            g_aof.fsync = policy == "always" ? FSYNC_ALWAYS
+                          : policy == "everysec" ? FSYNC_EVERYSEC : FSYNC_NO;
+        }
+        else if (arg == "--maxmemory-policy" && i + 1 < argc
+                 && (std::string(argv[i + 1]) == "lru" || std::string(argv[i + 1]) == "lfu"))
+        {
+            g_conf.evict_policy = std::string(argv[++i]) == "lru" ? EVICT_LRU : EVICT_LFU;
+        }
+        else
+        {
+            std::cerr << "usage: server [--threads N] [--idle-timeout SECONDS]"
+                      << " [--maxmemory BYTES[k|m|g]] [--maxmemory-policy lru|lfu]"
+                      << " [--appendonly FILE] [--appendfsync always|everysec|no]"
+                      << " [--dbfilename FILE] [--mmap] [--slowlog-usec USEC]"
+                      << " [--slowlog-max-len N] [--trace-file FILE]" << std::endl;
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+    // A random seed keeps clients from choosing keys that share a bucket
+    hash_seed_init();
+
+    uint32_t nthreads = g_conf.nthreads;
+    if (nthreads == 0)
+    {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    g_data.nshards = nthreads;
+    g_data.shards = new Shard[nthreads];
+
+    tsc_init();
+    slowlog_set_threshold(g_slowlog.threshold_us);
+
+    // Listeners are bound up front so that a bind failure is reported before serving
+    std::vector<Worker> workers(nthreads);
+    g_workers.workers = workers.data();
+    g_workers.nworkers = nthreads;
+    for (uint32_t i = 0; i < nthreads; i++)
+    {
+        workers[i].id = i;
+        workers[i].stats = new WorkerStats();
+        workers[i].trace = new TraceRing();
+        worker_init(&workers[i]);
+        g_data.shards[i].wakefd = workers[i].wakefd;
+    }
+
+    g_lazyfree.wakefd = eventfd(0, 0);
+    if (g_lazyfree.wakefd < 0)
+    {
+        die("eventfd()");
+    }
+    std::thread(lazyfree_loop).detach();
+    std::thread(trace_drain_loop).detach();
+    // the log has every write, so it wins over the snapshot
+    if (!g_aof.path.empty())
+    {
+        aof_init();
+    }
+    else if (g_conf.mmap_snapshot)
+    {
+        overlay_map();
+    }
+    else
+    {
+        snap_load(nthreads);
+    }
+    for (uint32_t i = 1; i < nthreads; i++)
+    {
+        workers[i].thread = std::thread(worker_loop, &workers[i]);
     }
+    worker_loop(&workers[0]);
 
     return 0;
 }
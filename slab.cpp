@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include <assert.h>
+#include "slab.h"
+
+static const uint16_t k_class_size[k_slab_nclass] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+// class index by (n + 15) / 16, so finding the class is a table lookup
+static uint8_t g_class_of[k_slab_max / 16 + 1];
+
+static bool class_init()
+{
+    size_t c = 0;
+    for (size_t i = 0; i <= k_slab_max / 16; i++)
+    {
+        while (k_class_size[c] < i * 16)
+        {
+            c++;
+        }
+        g_class_of[i] = (uint8_t)c;
+    }
+    return true;
+}
+
+size_t slab_class(size_t n)
+{
+    static bool init = class_init();
+    (void)init;
+    return n <= k_slab_max ? g_class_of[(n + 15) / 16] : k_slab_nclass;
+}
+
+size_t slab_class_size(size_t c)
+{
+    assert(c < k_slab_nclass);
+    return k_class_size[c];
+}
+
+Slab::Slab()
+{
+    for (size_t i = 0; i < k_slab_nclass; i++)
+    {
+        classes[i].size = k_class_size[i];
+    }
+}
+
+Slab::~Slab()
+{
+    for (void *page : pages)
+    {
+        ::free(page);
+    }
+}
+
+void *Slab::alloc(size_t n, size_t *usable)
+{
+    size_t c = slab_class(n);
+    if (c == k_slab_nclass)
+    {
+        void *p = malloc(n);
+        if (p)
+        {
+            *usable = malloc_usable_size(p);
+            large += *usable;
+        }
+        return p;
+    }
+
+    SlabClass &sc = classes[c];
+    *usable = sc.size;
+    sc.used++;
+    if (sc.free)
+    {
+        void *p = sc.free;
+        sc.free = *(void **)p;
+        return p;
+    }
+    if (sc.cur == NULL || (size_t)(sc.end - sc.cur) < sc.size)
+    {
+        // the tail of a page too small for a chunk is left unused
+        char *page = (char *)malloc(k_slab_page);
+        if (!page)
+        {
+            sc.used--;
+            return NULL;
+        }
+        pages.push_back(page);
+        sc.cur = page;
+        sc.end = page + k_slab_page;
+    }
+    void *p = sc.cur;
+    sc.cur += sc.size;
+    sc.total++;
+    return p;
+}
+
+void Slab::free(void *p, size_t n)
+{
+    size_t c = slab_class(n);
+    if (c == k_slab_nclass)
+    {
+        large -= n;
+        return ::free(p);
+    }
+    SlabClass &sc = classes[c];
+    assert(sc.used > 0);
+    sc.used--;
+    *(void **)p = sc.free;
+    sc.free = p;
+}
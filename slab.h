@@ -0,0 +1,52 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef SLAB_H
+#define SLAB_H
+
+// Chunks up to k_slab_max bytes come from size classes spaced 16 bytes
+// apart up to 128, then four per power of two, so at most 20% is wasted
+const size_t k_slab_max = 1024;
+const size_t k_slab_nclass = 19;
+const size_t k_slab_page = 64 << 10;
+
+struct SlabClass
+{
+    size_t size = 0;   // chunk size
+    void *free = NULL; // freed chunks, linked through their first word
+    char *cur = NULL;  // unused part of the newest page
+    char *end = NULL;
+    size_t used = 0;   // chunks handed out
+    size_t total = 0;  // chunks carved from pages
+};
+
+// Fixed size chunks carved from 64 KB pages, one free list per size class.
+// There is no per chunk header, the caller passes the size back to free().
+// Larger sizes fall through to malloc(), and their usable size is what
+// malloc_usable_size() reports. Pages are kept for reuse and only
+// returned when the slab is destroyed. Not thread safe.
+class Slab
+{
+public:
+    SlabClass classes[k_slab_nclass];
+    std::vector<void *> pages;
+    size_t large = 0; // bytes allocated with malloc()
+
+    Slab();
+    ~Slab();
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    // A chunk of at least n bytes, its actual size is stored in *usable
+    void *alloc(size_t n, size_t *usable);
+    // n is the size given to or returned by alloc()
+    void free(void *p, size_t n);
+};
+
+// The size class of a request, k_slab_nclass if it is too large
+size_t slab_class(size_t n);
+// The chunk size of a size class below k_slab_nclass
+size_t slab_class_size(size_t c);
+
+#endif
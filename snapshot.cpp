@@ -0,0 +1,405 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+static const char k_magic[8] = {'R', 'S', 'N', 'A', 'P', 0, 0, 0};
+static const char k_magic_end[8] = {'R', 'S', 'N', 'A', 'P', 'E', 'N', 'D'};
+const size_t k_header_size = 16;
+const size_t k_trailer_size = 16;
+const size_t k_section_entry = 8 + 8 + 8 + 4;
+const size_t k_snap_buf = 1 << 20;
+const size_t k_footer_fixed = 4 + 8 + 8 + 8 + 8 + 4;
+const uint64_t k_offset_mask = (1ull << 48) - 1;
+
+// CRC-32C (Castagnoli), sliced by 8 so it does not bound the load speed
+static uint32_t g_crc_table[8][256];
+
+static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+        }
+        g_crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint32_t prev = g_crc_table[t - 1][i];
+            g_crc_table[t][i] = (prev >> 8) ^ g_crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static bool init = (crc_init(), true);
+    (void)init;
+    crc = ~crc;
+    while (len >= 8)
+    {
+        uint64_t v = 0;
+        memcpy(&v, data, 8);
+        v ^= crc;
+        crc = g_crc_table[7][v & 0xff] ^ g_crc_table[6][(v >> 8) & 0xff]
+              ^ g_crc_table[5][(v >> 16) & 0xff] ^ g_crc_table[4][(v >> 24) & 0xff]
+              ^ g_crc_table[3][(v >> 32) & 0xff] ^ g_crc_table[2][(v >> 40) & 0xff]
+              ^ g_crc_table[1][(v >> 48) & 0xff] ^ g_crc_table[0][v >> 56];
+        data += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc >> 8) ^ g_crc_table[0][(crc ^ *data++) & 0xff];
+    }
+    return ~crc;
+}
+
+static bool write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv <= 0)
+        {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+bool SnapWriter::open(const char *path)
+{
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+    buf.append(k_magic, 8);
+    put_u32(k_snap_version);
+    put_u32(0);
+    flush(false);
+    return ok;
+}
+
+void SnapWriter::flush(bool in_section)
+{
+    if (in_section)
+    {
+        crc = crc32c(crc, (const uint8_t *)buf.data(), buf.size());
+    }
+    ok = ok && write_all(fd, buf.data(), buf.size());
+    off += buf.size();
+    buf.clear();
+}
+
+void SnapWriter::maybe_flush()
+{
+    if (buf.size() >= k_snap_buf)
+    {
+        flush(true);
+    }
+}
+
+void SnapWriter::index_init(uint64_t nkeys)
+{
+    // at most 3/4 full
+    uint64_t slots = 8;
+    while (slots * 3 < nkeys * 4)
+    {
+        slots *= 2;
+    }
+    index.assign(slots, 0);
+}
+
+void SnapWriter::index_add(uint64_t hcode)
+{
+    uint64_t mask = index.size() - 1;
+    uint64_t rec = off + buf.size();
+    uint64_t pos = hcode & mask;
+    while (index[pos])
+    {
+        pos = (pos + 1) & mask;
+    }
+    index[pos] = (hcode & ~k_offset_mask) | rec;
+}
+
+void SnapWriter::begin_section()
+{
+    start = off + buf.size();
+    crc = 0;
+}
+
+void SnapWriter::end_section(uint64_t nkeys)
+{
+    flush(true);
+    SnapSection sec;
+    sec.offset = start;
+    sec.size = off - start;
+    sec.nkeys = nkeys;
+    sec.crc = crc;
+    sections.push_back(sec);
+}
+
+bool SnapWriter::finish(uint64_t created_ms, uint64_t seed)
+{
+    // the index is read in place, so align it for u64 access
+    buf.append((8 - off % 8) % 8, '\0');
+    uint64_t index_off = off + buf.size();
+    flush(false);
+    ok = ok && write_all(fd, (const char *)index.data(), index.size() * 8);
+    off += index.size() * 8;
+
+    uint64_t footer = off;
+    put_u32((uint32_t)sections.size());
+    for (SnapSection &sec : sections)
+    {
+        put_u64(sec.offset);
+        put_u64(sec.size);
+        put_u64(sec.nkeys);
+        put_u32(sec.crc);
+    }
+    put_u64(created_ms);
+    put_u64(seed);
+    put_u64(index_off);
+    put_u64(index.size());
+    put_u32(crc32c(0, (const uint8_t *)buf.data(), buf.size()));
+    put_u64(footer);
+    buf.append(k_magic_end, 8);
+    flush(false);
+    ok = ok && fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+    }
+    return ok;
+}
+
+void SnapWriter::put_varint(uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+void SnapWriter::put_str(std::string_view s)
+{
+    put_varint(s.size());
+    buf.append(s);
+}
+
+uint8_t SnapReader::get_u8()
+{
+    if (cur + 1 > end)
+    {
+        ok = false;
+        return 0;
+    }
+    return *cur++;
+}
+
+uint64_t SnapReader::get_u64()
+{
+    uint64_t v = 0;
+    if (cur + 8 > end)
+    {
+        ok = false;
+        return 0;
+    }
+    memcpy(&v, cur, 8);
+    cur += 8;
+    return v;
+}
+
+double SnapReader::get_f64()
+{
+    uint64_t bits = get_u64();
+    double v = 0;
+    memcpy(&v, &bits, 8);
+    return v;
+}
+
+uint64_t SnapReader::get_varint()
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t b = get_u8();
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            return v;
+        }
+    }
+    ok = false;
+    return 0;
+}
+
+std::string_view SnapReader::get_str()
+{
+    uint64_t len = get_varint();
+    if (!ok || len > (uint64_t)(end - cur))
+    {
+        ok = false;
+        return std::string_view();
+    }
+    std::string_view s((const char *)cur, len);
+    cur += len;
+    return s;
+}
+
+bool SnapFile::open(const char *path, std::string &err)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        err = "cannot open";
+        return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) || (size_t)st.st_size < k_header_size + k_footer_fixed + k_trailer_size)
+    {
+        ::close(fd);
+        err = "file too short";
+        return false;
+    }
+    size = (size_t)st.st_size;
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        err = "mmap failed";
+        return false;
+    }
+    data = (const uint8_t *)p;
+
+    uint32_t version = 0;
+    memcpy(&version, &data[8], 4);
+    uint64_t footer = 0;
+    memcpy(&footer, &data[size - k_trailer_size], 8);
+    if (memcmp(data, k_magic, 8) || memcmp(&data[size - 8], k_magic_end, 8))
+    {
+        err = "bad magic";
+    }
+    else if (version != k_snap_version)
+    {
+        err = "unsupported version " + std::to_string(version);
+    }
+    else if (footer < k_header_size || footer + k_footer_fixed > size - k_trailer_size)
+    {
+        err = "bad footer offset";
+    }
+    if (!err.empty())
+    {
+        close();
+        return false;
+    }
+
+    const uint8_t *f = &data[footer];
+    size_t flen = size - k_trailer_size - footer;
+    uint32_t n = 0;
+    memcpy(&n, f, 4);
+    uint32_t crc = 0;
+    memcpy(&crc, &f[flen - 4], 4);
+    if (flen != (size_t)n * k_section_entry + k_footer_fixed || crc32c(0, f, flen - 4) != crc)
+    {
+        err = "footer checksum mismatch";
+        close();
+        return false;
+    }
+    f += 4;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        SnapSection sec;
+        memcpy(&sec.offset, f, 8);
+        memcpy(&sec.size, f + 8, 8);
+        memcpy(&sec.nkeys, f + 16, 8);
+        memcpy(&sec.crc, f + 24, 4);
+        f += k_section_entry;
+        if (sec.offset < k_header_size || sec.offset + sec.size > footer)
+        {
+            err = "bad section bounds";
+            close();
+            return false;
+        }
+        sections.push_back(sec);
+    }
+    memcpy(&created_ms, f, 8);
+    memcpy(&seed, f + 8, 8);
+    uint64_t index_off = 0;
+    memcpy(&index_off, f + 16, 8);
+    memcpy(&index_slots, f + 24, 8);
+    if (index_off % 8 || index_slots == 0 || (index_slots & (index_slots - 1))
+        || index_off + index_slots * 8 != footer)
+    {
+        err = "bad index";
+        close();
+        return false;
+    }
+    index = (const uint64_t *)&data[index_off];
+    return true;
+}
+
+const uint8_t *SnapFile::slot_record(uint64_t slot)
+{
+    uint64_t v = index[slot];
+    uint64_t rec = v & k_offset_mask;
+    // an offset outside the sections is treated as absent
+    return v && rec >= k_header_size && rec < size ? &data[rec] : NULL;
+}
+
+const uint8_t *SnapFile::find(uint64_t hcode, std::string_view key, uint64_t *slot)
+{
+    uint64_t mask = index_slots - 1;
+    for (uint64_t pos = hcode & mask, n = 0; index[pos] && n <= mask; pos = (pos + 1) & mask, n++)
+    {
+        if ((index[pos] & ~k_offset_mask) != (hcode & ~k_offset_mask))
+        {
+            continue;
+        }
+        const uint8_t *rec = slot_record(pos);
+        if (!rec)
+        {
+            continue;
+        }
+        SnapReader r = reader(rec);
+        r.get_u8();
+        r.get_u8();
+        if (r.get_str() == key && r.ok)
+        {
+            *slot = pos;
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+const uint8_t *SnapFile::section(size_t i)
+{
+    SnapSection &sec = sections[i];
+    const uint8_t *p = &data[sec.offset];
+    return crc32c(0, p, sec.size) == sec.crc ? p : NULL;
+}
+
+void SnapFile::close()
+{
+    if (data)
+    {
+        munmap((void *)data, size);
+    }
+    data = NULL;
+    size = 0;
+    index = NULL;
+    index_slots = 0;
+    sections.clear();
+}
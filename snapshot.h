@@ -0,0 +1,122 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+// Binary snapshot file:
+//
+//   header   "RSNAP\0\0\0" | u32 version | u32 reserved
+//   sections records, each section is checksummed on its own
+//   index    u64 slots, 8 byte aligned
+//   footer   u32 n | n * {u64 offset, u64 size, u64 nkeys, u32 crc}
+//            | u64 created_ms | u64 seed | u64 index offset | u64 index slots
+//            | u32 crc of the footer
+//   trailer  u64 footer offset | "RSNAPEND"
+//
+// Integers are little endian. Sections are independent, so a loader can
+// verify and decode them in parallel. Every record starts with u8 type,
+// u8 flags and the key as a varint length and bytes.
+//
+// The index is an open addressing table, probed linearly, of the records
+// by str_hash_seed(key, seed). A slot is 0 when empty, otherwise the top
+// 16 bits of the hash and the 48 bit offset of the record, so a server
+// can map the file and find keys without loading it.
+const uint32_t k_snap_version = 2;
+
+struct SnapSection
+{
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t nkeys = 0;
+    uint32_t crc = 0;
+};
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
+
+// Streams a snapshot to a file through a buffer
+class SnapWriter
+{
+public:
+    int fd = -1;
+    bool ok = false;
+    uint64_t off = 0; // bytes written to fd
+    std::string buf;
+    uint32_t crc = 0;  // of the current section up to buf
+    uint64_t start = 0; // offset of the current section
+    std::vector<SnapSection> sections;
+    std::vector<uint64_t> index;
+
+    bool open(const char *path);
+    // sizes the index for at most nkeys records
+    void index_init(uint64_t nkeys);
+    // adds the record about to be written, hcode is str_hash_seed(key, seed)
+    void index_add(uint64_t hcode);
+    void begin_section();
+    void end_section(uint64_t nkeys);
+    // writes the footer and syncs the file, false on any error
+    bool finish(uint64_t created_ms, uint64_t seed);
+
+    void put_u8(uint8_t v) { buf.push_back((char)v); }
+    void put_u32(uint32_t v) { buf.append((char *)&v, 4); }
+    void put_u64(uint64_t v) { buf.append((char *)&v, 8); }
+    void put_f64(double v) { buf.append((char *)&v, 8); }
+    void put_varint(uint64_t v);
+    void put_str(std::string_view s);
+    // flushes once enough is buffered
+    void maybe_flush();
+
+private:
+    void flush(bool in_section);
+};
+
+// Bounds checked decoding of one section
+class SnapReader
+{
+public:
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+    bool ok = true;
+
+    SnapReader(const uint8_t *data, size_t len)
+    {
+        cur = data;
+        end = data + len;
+    }
+
+    uint8_t get_u8();
+    uint64_t get_u64();
+    double get_f64();
+    uint64_t get_varint();
+    std::string_view get_str();
+};
+
+// A snapshot mapped into memory with its footer checked
+class SnapFile
+{
+public:
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    uint64_t created_ms = 0;
+    uint64_t seed = 0; // of the hashes in the index
+    const uint64_t *index = NULL;
+    uint64_t index_slots = 0;
+    std::vector<SnapSection> sections;
+
+    // false with a message in err if the file is missing or invalid
+    bool open(const char *path, std::string &err);
+    // the section bytes, NULL if the checksum does not match
+    const uint8_t *section(size_t i);
+    // the record of a key by its index hash, NULL if absent
+    const uint8_t *find(uint64_t hcode, std::string_view key, uint64_t *slot);
+    // the record an index slot points to, NULL for an empty slot
+    const uint8_t *slot_record(uint64_t slot);
+    // a reader over the rest of the file, starting at a record
+    SnapReader reader(const uint8_t *rec) { return SnapReader(rec, data + size - rec); }
+    void close();
+};
+
+#endif
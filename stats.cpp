@@ -0,0 +1,122 @@
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "stats.h"
+
+static uint64_t monotonic_ns()
+{
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+uint64_t tsc_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+static uint64_t g_base_tsc = 0;
+static uint64_t g_base_ns = 0;
+
+void tsc_init()
+{
+    g_base_ns = monotonic_ns();
+    g_base_tsc = tsc_now();
+    // a first measurement window, so the rate is usable right away
+    usleep(10000);
+}
+
+double tsc_per_ns()
+{
+    uint64_t ns = monotonic_ns() - g_base_ns;
+    uint64_t ticks = tsc_now() - g_base_tsc;
+    return ns ? (double)ticks / (double)ns : 1.0;
+}
+
+size_t hist_bucket(uint64_t v)
+{
+    if (v < k_hist_sub)
+    {
+        return (size_t)v;
+    }
+    uint32_t e = 63 - __builtin_clzll(v);
+    if (e > k_hist_max_bits)
+    {
+        return k_hist_buckets - 1;
+    }
+    // the top k_hist_sub_bits + 1 bits of v, without the leading one
+    return (e - k_hist_sub_bits + 1) * k_hist_sub + ((v >> (e - k_hist_sub_bits)) & (k_hist_sub - 1));
+}
+
+uint64_t hist_bucket_max(size_t idx)
+{
+    if (idx < k_hist_sub)
+    {
+        return idx;
+    }
+    uint32_t e = (uint32_t)(idx / k_hist_sub) + k_hist_sub_bits - 1;
+    uint64_t low = (k_hist_sub + idx % k_hist_sub) << (e - k_hist_sub_bits);
+    return low + (1ull << (e - k_hist_sub_bits)) - 1;
+}
+
+void Histogram::record(uint64_t v)
+{
+    stat_add(counts[hist_bucket(v)], 1);
+    stat_add(count, 1);
+    stat_add(sum, v);
+    if (v > max.load(std::memory_order_relaxed))
+    {
+        max.store(v, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::merge(const Histogram &h)
+{
+    for (size_t i = 0; i < k_hist_buckets; i++)
+    {
+        counts[i].fetch_add(h.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    count.fetch_add(h.count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    sum.fetch_add(h.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    uint64_t m = h.max.load(std::memory_order_relaxed);
+    if (m > max.load(std::memory_order_relaxed))
+    {
+        max.store(m, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    assert(p >= 0 && p <= 1);
+    // the counts are read one by one, so their sum may differ from `count`
+    uint64_t total = 0;
+    for (size_t i = 0; i < k_hist_buckets; i++)
+    {
+        total += counts[i].load(std::memory_order_relaxed);
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)ceil(p * (double)total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_hist_buckets; i++)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            // the bucket bound may be above anything recorded
+            return std::min(hist_bucket_max(i), max.load(std::memory_order_relaxed));
+        }
+    }
+    return max.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,61 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifndef STATS_H
+#define STATS_H
+
+// Cycle counter for timing the hot path. On x86 this is rdtsc, which
+// needs an invariant TSC, elsewhere the monotonic clock in nanoseconds.
+// Ticks are converted with tsc_per_ns() only when reported.
+uint64_t tsc_now();
+// Records the reference point of tsc_per_ns(), call once at startup.
+// Sleeps 10 ms so that the first measurement is meaningful.
+void tsc_init();
+// Ticks per nanosecond, measured against the monotonic clock since
+// tsc_init(), so it gets more accurate the longer the server runs
+double tsc_per_ns();
+
+// Log-linear buckets as in HDR histograms: values below k_hist_sub are
+// exact, above that each power of two is split into k_hist_sub buckets,
+// so a value is off by at most 1/k_hist_sub (3%). Values are capped at
+// 2^k_hist_max_bits.
+const uint32_t k_hist_sub_bits = 5;
+const uint64_t k_hist_sub = 1 << k_hist_sub_bits;
+const uint32_t k_hist_max_bits = 40;
+const size_t k_hist_buckets = (k_hist_max_bits - k_hist_sub_bits + 2) * k_hist_sub;
+
+// Written by one thread and read by any. Counters are relaxed atomics, so
+// recording costs plain loads and stores, and a reader may see a count
+// that is a few values behind.
+class Histogram
+{
+public:
+    std::atomic<uint64_t> counts[k_hist_buckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+
+    Histogram() = default;
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+
+    // only from the owning thread
+    void record(uint64_t v);
+    // adds the counts of `h`, for reporting several histograms as one
+    void merge(const Histogram &h);
+    // the value at or below which a fraction p of the values fall
+    uint64_t percentile(double p) const;
+};
+
+// Adds to a counter that only the calling thread writes
+inline void stat_add(std::atomic<uint64_t> &c, uint64_t n)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+size_t hist_bucket(uint64_t v);
+// the highest value that falls in a bucket
+uint64_t hist_bucket_max(size_t idx);
+
+#endif
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <assert.h>
 #include <set>
+#include <vector>
+#include <stdlib.h>
 
 #include "avl.h"
 
@@ -78,8 +80,6 @@ void avl_verify(AVLNode *parent, AVLNode *node)
     avl_verify(node, node->left);
     avl_verify(node, node->right);
 
-    std::cout << parent << " " << ((parent) ? container_of(parent, Data, node)->val : 9191) << " | " << node << " " << container_of(node, Data, node)->val << std::endl;
-
     assert(node->cnt == 1 + avl_cnt(node->left) + avl_cnt(node->right));
 
     uint32_t l = avl_depth(node->left);
@@ -131,6 +131,112 @@ void dispose(Container &c)
     }
 }
 
+static uint32_t val_of(AVLNode *node)
+{
+    return container_of(node, Data, node)->val;
+}
+
+// Offset, rank and iteration agree with the sorted order of the reference
+void order_verify(Container &c, const std::multiset<uint32_t> &ref)
+{
+    std::vector<uint32_t> sorted(ref.begin(), ref.end());
+    std::vector<AVLNode *> nodes;
+    for (AVLNode *node = avl_first(c.root); node; node = avl_next(node))
+    {
+        nodes.push_back(node);
+    }
+    assert(nodes.size() == sorted.size());
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        assert(val_of(nodes[i]) == sorted[i]);
+        assert(avl_rank(nodes[i]) == (int64_t)i);
+    }
+
+    std::vector<AVLNode *> reversed;
+    for (AVLNode *node = avl_last(c.root); node; node = avl_prev(node))
+    {
+        reversed.push_back(node);
+    }
+    assert(std::vector<AVLNode *>(reversed.rbegin(), reversed.rend()) == nodes);
+
+    // A few random starting points, every target plus out of range ones
+    for (size_t k = 0; k < 4 && !nodes.empty(); k++)
+    {
+        size_t i = (size_t)rand() % nodes.size();
+        for (int64_t j = -1; j <= (int64_t)nodes.size(); j++)
+        {
+            AVLNode *found = avl_offset(nodes[i], j - (int64_t)i);
+            if (j < 0 || j == (int64_t)nodes.size())
+            {
+                assert(found == NULL);
+            }
+            else
+            {
+                assert(found == nodes[j]);
+            }
+        }
+    }
+}
+
+// Insert every value into trees of every shape up to `sz`
+void test_insert(uint32_t sz)
+{
+    for (uint32_t val = 0; val < sz; val++)
+    {
+        Container c;
+        std::multiset<uint32_t> ref;
+        for (uint32_t i = 0; i < sz; i++)
+        {
+            if (i == val)
+            {
+                continue;
+            }
+            add(c, i);
+            ref.insert(i);
+        }
+        container_verify(c, ref);
+
+        add(c, val);
+        ref.insert(val);
+        container_verify(c, ref);
+        order_verify(c, ref);
+        dispose(c);
+    }
+}
+
+// Random operations checked against std::multiset
+void test_random(uint32_t rounds, uint32_t range)
+{
+    Container c;
+    std::multiset<uint32_t> ref;
+    for (uint32_t i = 0; i < rounds; i++)
+    {
+        uint32_t val = (uint32_t)rand() % range;
+        if (rand() % 3)
+        {
+            add(c, val);
+            ref.insert(val);
+        }
+        else
+        {
+            auto it = ref.find(val);
+            assert(del(c, val) == (it != ref.end()));
+            if (it != ref.end())
+            {
+                ref.erase(it);
+            }
+        }
+        container_verify(c, ref);
+        if (i % 16 == 0)
+        {
+            order_verify(c, ref);
+        }
+    }
+    order_verify(c, ref);
+    dispose(c);
+}
+
 int main()
 {
     Container c;
@@ -148,6 +254,16 @@ int main()
         ref.insert(i);
         container_verify(c, ref);
     }
+    order_verify(c, ref);
+    dispose(c);
+
+    srand(1);
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        test_insert(i);
+    }
+    test_random(5000, 200);
+    test_random(5000, 2000);
 
     return 0;
 }
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <assert.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+#include "flatmap.h"
+
+#define container_of(ptr, type, member) ({ \
+    const typeof(((type *)0 ) -> member)* __mptr =  (ptr); \
+    (type * ) ((char *)__mptr - offsetof(type, member)); })
+
+struct Data
+{
+    HNode node;
+    uint32_t key;
+    uint32_t val;
+};
+
+static uint64_t hash(uint32_t key)
+{
+    // Weak on purpose in the low bits, so groups and fingerprints collide
+    return (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+}
+
+static bool data_eq(HNode *node, const HKey *key)
+{
+    return container_of(node, Data, node)->key == *(const uint32_t *)key->data;
+}
+
+static HKey make_key(const uint32_t *k)
+{
+    HKey key;
+    key.data = (const uint8_t *)k;
+    key.len = sizeof(*k);
+    key.hcode = hash(*k);
+    return key;
+}
+
+static Data *lookup(FlatMap &fm, uint32_t k)
+{
+    HKey key = make_key(&k);
+    HNode *node = fm.fm_lookup(&key, &data_eq);
+    return node ? container_of(node, Data, node) : NULL;
+}
+
+static void verify(FlatMap &fm, std::unordered_map<uint32_t, uint32_t> &ref)
+{
+    assert(fm.fm_size() == ref.size());
+    for (auto &kv : ref)
+    {
+        Data *d = lookup(fm, kv.first);
+        assert(d && d->val == kv.second);
+    }
+}
+
+int main()
+{
+    FlatMap fm;
+    assert(lookup(fm, 1) == NULL);
+
+    std::unordered_map<uint32_t, uint32_t> ref;
+    srand(123);
+    for (uint32_t i = 0; i < 200000; i++)
+    {
+        uint32_t k = (uint32_t)rand() % 20000;
+        if (rand() % 3)
+        {
+            Data *d = lookup(fm, k);
+            if (d)
+            {
+                d->val = i;
+            }
+            else
+            {
+                d = new Data();
+                d->key = k;
+                d->val = i;
+                d->node.hcode = hash(k);
+                fm.fm_insert(&d->node);
+            }
+            ref[k] = i;
+        }
+        else
+        {
+            HKey key = make_key(&k);
+            HNode *node = fm.fm_pop(&key, &data_eq);
+            assert((node != NULL) == (ref.erase(k) == 1));
+            delete container_of(node, Data, node);
+            assert(lookup(fm, k) == NULL);
+        }
+        if (i % 10000 == 0)
+        {
+            verify(fm, ref);
+        }
+    }
+    verify(fm, ref);
+
+    // Tombstone heavy workload must not exhaust the table
+    for (auto &kv : ref)
+    {
+        uint32_t k = kv.first;
+        HKey key = make_key(&k);
+        delete container_of(fm.fm_pop(&key, &data_eq), Data, node);
+    }
+    ref.clear();
+    verify(fm, ref);
+    for (uint32_t i = 0; i < 100000; i++)
+    {
+        Data *d = new Data();
+        d->key = i;
+        d->val = i;
+        d->node.hcode = hash(i);
+        fm.fm_insert(&d->node);
+        HKey key = make_key(&d->key);
+        assert(fm.fm_pop(&key, &data_eq) == &d->node);
+        delete d;
+    }
+    verify(fm, ref);
+
+    fm.t1.f_free();
+    fm.t2.f_free();
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <assert.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "hashtable.h"
+
+#define container_of(ptr, type, member) ({ \
+    const typeof(((type *)0 ) -> member)* __mptr =  (ptr); \
+    (type * ) ((char *)__mptr - offsetof(type, member)); })
+
+// The hash the server used before, kept here to build the attack
+static uint64_t fnv_hash(const uint8_t *data, size_t len)
+{
+    uint64_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+struct Data
+{
+    HNode node;
+    std::string key;
+};
+
+// Keys whose old hash agrees in the low `bits` bits, so they all land in
+// one bucket of any table with up to 2^bits slots
+static std::vector<std::string> attack_keys(size_t n, uint32_t bits)
+{
+    const uint64_t mask = (1ULL << bits) - 1;
+    std::vector<std::string> keys;
+    srand(7);
+    while (keys.size() < n)
+    {
+        std::string key = "user:" + std::to_string(rand()) + "::";
+        for (uint32_t a = 0; a < 256 && keys.size() < n; a++)
+        {
+            for (uint32_t b = 0; b < 256; b++)
+            {
+                key[key.size() - 2] = (char)a;
+                key[key.size() - 1] = (char)b;
+                if ((fnv_hash((const uint8_t *)key.data(), key.size()) & mask) == 0)
+                {
+                    keys.push_back(key);
+                    break;
+                }
+            }
+        }
+    }
+    return keys;
+}
+
+static size_t max_chain(HTab &t)
+{
+    size_t longest = 0;
+    for (size_t i = 0; t.tab && i <= t.mask; i++)
+    {
+        size_t len = 0;
+        for (HNode *node = t.tab[i]; node; node = node->next)
+        {
+            len++;
+        }
+        longest = std::max(longest, len);
+    }
+    return longest;
+}
+
+static size_t fill(HMap &hm, const std::vector<std::string> &keys,
+                   uint64_t (*hash)(const uint8_t *, size_t))
+{
+    for (const std::string &k : keys)
+    {
+        Data *d = new Data();
+        d->key = k;
+        d->node.hcode = hash((const uint8_t *)k.data(), k.size());
+        hm.hm_insert(&d->node);
+    }
+    return std::max(max_chain(hm.ht1), max_chain(hm.ht2));
+}
+
+int main()
+{
+    // Same input, same seed, same hash. Every length takes a different path.
+    std::string s(200, 'x');
+    for (size_t len = 0; len <= s.size(); len++)
+    {
+        const uint8_t *p = (const uint8_t *)s.data();
+        assert(str_hash(p, len) == str_hash(p, len));
+        if (len > 0)
+        {
+            assert(str_hash(p, len) != str_hash(p, len - 1));
+        }
+    }
+
+    // Changing the seed changes the hash
+    hash_seed_init();
+    uint64_t seed = hash_seed();
+    const uint8_t *k = (const uint8_t *)"key";
+    assert(str_hash(k, 3) == str_hash_seed(k, 3, seed));
+    assert(str_hash_seed(k, 3, seed) != str_hash_seed(k, 3, seed + 1));
+
+    // Collision attack on the old hash: 4096 keys sharing the low 12 bits
+    std::vector<std::string> keys = attack_keys(4096, 12);
+
+    HMap fnv_map;
+    size_t fnv_chain = fill(fnv_map, keys, fnv_hash);
+    HMap seeded_map;
+    size_t seeded_chain = fill(seeded_map, keys, str_hash);
+    std::cout << "longest chain: fnv " << fnv_chain << ", str_hash " << seeded_chain << std::endl;
+
+    // With the old hash the resize never splits the chain
+    assert(fnv_chain >= keys.size() / 2);
+    // With the seeded hash the chains stay near the load factor
+    assert(seeded_chain <= 32);
+    return 0;
+}
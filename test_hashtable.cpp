@@ -0,0 +1,156 @@
+#include <iostream>
+#include <assert.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+
+#include "hashtable.h"
+
+#define container_of(ptr, type, member) ({ \
+    const typeof(((type *)0 ) -> member)* __mptr =  (ptr); \
+    (type * ) ((char *)__mptr - offsetof(type, member)); })
+
+struct Data
+{
+    HNode node;
+    uint32_t key;
+};
+
+static uint64_t hash(uint32_t key)
+{
+    return (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+}
+
+static Data *add(HMap &hm, uint32_t k)
+{
+    Data *d = new Data();
+    d->key = k;
+    d->node.hcode = hash(k);
+    hm.hm_insert(&d->node);
+    return d;
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+    ((std::multiset<uint32_t> *)arg)->insert(container_of(node, Data, node)->key);
+}
+
+static bool same_node(HNode *lhs, HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+// A scan must report every key that exists for its whole duration, while
+// other keys are added and removed and the table resizes in between.
+static void test_scan(uint32_t nstable, uint32_t nchurn)
+{
+    HMap hm;
+    for (uint32_t i = 0; i < nstable; i++)
+    {
+        add(hm, i);
+    }
+
+    std::multiset<uint32_t> seen;
+    std::vector<Data *> churn;
+    uint32_t next_key = nstable;
+    size_t cursor = 0;
+    do
+    {
+        cursor = hm.hm_scan(cursor, &cb_collect, &seen);
+        for (uint32_t i = 0; i < nchurn; i++)
+        {
+            churn.push_back(add(hm, next_key++));
+        }
+        if (!churn.empty() && rand() % 2)
+        {
+            size_t pos = (size_t)rand() % churn.size();
+            Data *d = churn[pos];
+            churn[pos] = churn.back();
+            churn.pop_back();
+            assert(hm.hm_pop(&d->node, &same_node) == &d->node);
+            delete d;
+        }
+    } while (cursor != 0);
+
+    for (uint32_t i = 0; i < nstable; i++)
+    {
+        assert(seen.count(i) >= 1);
+    }
+    // nothing is reported that never existed
+    for (uint32_t k : seen)
+    {
+        assert(k < next_key);
+    }
+}
+
+static bool data_eq(HNode *node, const HKey *key)
+{
+    return container_of(node, Data, node)->key == *(const uint32_t *)key->data;
+}
+
+// Batched lookups find the same nodes as one at a time, also while the
+// table is resizing and for keys in both of its tables
+static void test_lookup_batch(uint32_t n)
+{
+    HMap hm;
+    std::vector<uint32_t> want;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        add(hm, i);
+        want.push_back(i * 2); // half of them present
+        if (i % 97 != 0)
+        {
+            continue;
+        }
+        std::vector<HKey> keys(want.size());
+        for (size_t j = 0; j < want.size(); j++)
+        {
+            keys[j] = HKey{(const uint8_t *)&want[j], sizeof(uint32_t), hash(want[j])};
+        }
+        std::vector<HNode *> got(keys.size());
+        hm.hm_lookup_batch(keys.data(), keys.size(), &data_eq, got.data());
+        for (size_t j = 0; j < keys.size(); j++)
+        {
+            assert(got[j] == hm.hm_lookup(&keys[j], &data_eq));
+            assert(!got[j] == (want[j] > i));
+        }
+    }
+}
+
+int main()
+{
+    HMap hm;
+    assert(hm.hm_scan(0, &cb_collect, NULL) == 0);
+
+    srand(123);
+    // without changes, even mid-resize, every key is reported exactly once
+    for (uint32_t n : {1, 10, 1000, 50000})
+    {
+        HMap stable;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            add(stable, i);
+        }
+        std::multiset<uint32_t> seen;
+        size_t cursor = 0;
+        do
+        {
+            cursor = stable.hm_scan(cursor, &cb_collect, &seen);
+        } while (cursor != 0);
+        assert(seen.size() == n);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            assert(seen.count(i) == 1);
+        }
+    }
+
+    // growing while scanning
+    test_scan(10, 1);
+    test_scan(1000, 1);
+    test_scan(1000, 8);
+    test_scan(20000, 3);
+
+    test_lookup_batch(1);
+    test_lookup_batch(5000);
+    return 0;
+}
@@ -0,0 +1,311 @@
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kvclient.h"
+
+// Appends a length header and the value, the way the server frames it
+static void put_res(std::string &out, const std::string &val)
+{
+    uint32_t len = (uint32_t)val.size();
+    out.append((char *)&len, 4);
+    out.append(val);
+}
+
+static std::string ser_str(std::string_view s)
+{
+    std::string out(1, (char)SER_STR);
+    uint32_t len = (uint32_t)s.size();
+    out.append((char *)&len, 4);
+    out.append(s);
+    return out;
+}
+
+static std::string ser_int(int64_t v)
+{
+    std::string out(1, (char)SER_INT);
+    out.append((char *)&v, 8);
+    return out;
+}
+
+static int64_t decode(const std::string &s, KVValue *val)
+{
+    return kv_decode((const uint8_t *)s.data(), s.size(), val);
+}
+
+static void test_decode()
+{
+    // [nil, "ab", [1, 2.5]]
+    std::string arr(1, (char)SER_ARR);
+    uint32_t n = 2;
+    arr.append((char *)&n, 4);
+    arr.append(ser_int(1));
+    arr.push_back((char)SER_DBL);
+    double d = 2.5;
+    arr.append((char *)&d, 8);
+    std::string top(1, (char)SER_ARR);
+    n = 3;
+    top.append((char *)&n, 4);
+    top.push_back((char)SER_NIL);
+    top.append(ser_str("ab"));
+    top.append(arr);
+
+    KVValue val;
+    assert(decode(top, &val) == (int64_t)top.size());
+    assert(val.type == SER_ARR && val.arr.size() == 3);
+    assert(val.arr[0].type == SER_NIL);
+    assert(val.arr[1].type == SER_STR && val.arr[1].str == "ab");
+    assert(val.arr[2].arr.size() == 2 && val.arr[2].raw == arr);
+    assert(val.arr[2].arr[0].i == 1 && val.arr[2].arr[1].d == 2.5);
+    // the strings point into the input
+    assert(val.arr[1].str.data() == top.data() + 1 + 4 + 1 + 1 + 4);
+
+    // every truncation is incomplete, not a crash
+    for (size_t i = 0; i < top.size(); i++)
+    {
+        assert(kv_decode((const uint8_t *)top.data(), i, &val) < 0);
+    }
+    // an absurd array length does not allocate for it
+    std::string bogus(1, (char)SER_ARR);
+    n = UINT32_MAX;
+    bogus.append((char *)&n, 4);
+    assert(decode(bogus, &val) < 0);
+    assert(decode(std::string(1, (char)9), &val) < 0);
+
+    // nesting is bounded, so a hostile stream cannot exhaust the stack
+    std::string nest;
+    n = 1;
+    for (uint32_t i = 0; i <= k_kv_max_depth; i++)
+    {
+        nest.push_back((char)SER_ARR);
+        nest.append((char *)&n, 4);
+    }
+    nest.push_back((char)SER_NIL);
+    assert(decode(nest.substr(5), &val) == (int64_t)nest.size() - 5);
+    assert(decode(nest, &val) < 0);
+    std::string deep;
+    for (size_t i = 0; i < 1000000; i++)
+    {
+        deep.push_back((char)SER_ARR);
+        deep.append((char *)&n, 4);
+    }
+    assert(decode(deep, &val) < 0);
+
+    KVReply reply(top);
+    assert(reply.value.arr[1].str == "ab");
+    assert((const uint8_t *)reply.value.arr[1].str.data() > reply.raw.data());
+    KVReply moved(std::move(reply));
+    assert(moved.value.arr[2].arr[1].d == 2.5);
+}
+
+static void test_encode()
+{
+    std::string out;
+    kv_encode(out, {"set", "k", ""});
+    std::string want;
+    uint32_t v = 4 + 7 + 5 + 4;
+    want.append((char *)&v, 4);
+    v = 3;
+    want.append((char *)&v, 4);
+    for (std::string_view s : {"set", "k", ""})
+    {
+        v = (uint32_t)s.size();
+        want.append((char *)&v, 4);
+        want.append(s);
+    }
+    assert(out == want);
+}
+
+// KVConn over a socketpair, the test playing the server
+static void test_conn()
+{
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    KVConn conn;
+    conn.attach(fds[0]);
+
+    std::vector<std::string> got;
+    KVConn::Callback cb = [&](const KVValue &val) {
+        got.push_back(val.type == SER_STR ? std::string(val.str)
+                                          : std::to_string(val.type));
+    };
+    conn.send({"get", "a"}, cb);
+    conn.send({"incr", "b"}, cb);
+    conn.send({"get", "c"}, cb);
+    assert(conn.want_write());
+    assert(conn.flush() && !conn.want_write());
+
+    // the queued requests arrive in one read
+    std::string want;
+    kv_encode(want, {"get", "a"});
+    kv_encode(want, {"incr", "b"});
+    kv_encode(want, {"get", "c"});
+    std::string buf(want.size() + 1, '\0');
+    assert(read(fds[1], &buf[0], buf.size()) == (ssize_t)want.size());
+    buf.resize(want.size());
+    assert(buf == want);
+
+    // responses split at odd places still come out whole and in order
+    std::string res;
+    put_res(res, ser_str("x"));
+    put_res(res, ser_int(7));
+    put_res(res, ser_str("zz"));
+    assert(write(fds[1], res.data(), 3) == 3);
+    assert(conn.read() && got.empty());
+    assert(write(fds[1], res.data() + 3, 10) == 10);
+    assert(conn.read() && got.size() == 1 && got[0] == "x");
+    assert(write(fds[1], res.data() + 13, res.size() - 13) == (ssize_t)(res.size() - 13));
+    assert(conn.read() && got.size() == 3);
+    assert(got[1] == std::to_string(SER_INT) && got[2] == "zz");
+
+    // losing the connection fails what is in flight, and what comes later
+    int32_t code = 0;
+    std::string error;
+    KVConn::Callback on_err = [&](const KVValue &val) {
+        assert(val.type == SER_ERR);
+        code = val.code;
+        error = val.str;
+    };
+    conn.send({"get", "d"}, on_err);
+    assert(conn.flush());
+    assert(read(fds[1], &buf[0], buf.size()) > 0);
+    close(fds[1]);
+    assert(!conn.read() && conn.broken);
+    assert(code == k_kv_err_conn && error == "connection closed");
+    code = 0;
+    conn.send({"get", "e"}, on_err);
+    assert(code == k_kv_err_conn && conn.pending.empty());
+}
+
+// KVClient that cannot connect answers every call with an error
+static void test_client_refused()
+{
+    KVClient client("127.0.0.1", 1, 2);
+    std::vector<std::future<KVReply>> replies;
+    for (int i = 0; i < 10; i++)
+    {
+        replies.push_back(client.call({"get", "a"}));
+    }
+    for (std::future<KVReply> &fut : replies)
+    {
+        KVReply reply = fut.get();
+        assert(reply.value.type == SER_ERR && reply.value.code == k_kv_err_conn);
+    }
+}
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, p, n);
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        n -= (size_t)rv;
+    }
+    return true;
+}
+
+// Serves `nconns` connections one after another. "echo x" is answered
+// with "x", and "quit" closes the connection without an answer.
+static void echo_server(int lfd, int nconns)
+{
+    for (int i = 0; i < nconns; i++)
+    {
+        int fd = accept(lfd, NULL, NULL);
+        assert(fd >= 0);
+        uint32_t len = 0;
+        while (read_full(fd, &len, 4))
+        {
+            std::string req(len, '\0');
+            assert(read_full(fd, &req[0], len));
+            // the last argument, after the count and its own length
+            uint32_t nargs = 0, alen = 0;
+            memcpy(&nargs, req.data(), 4);
+            size_t pos = 4;
+            for (uint32_t j = 0; j < nargs; j++)
+            {
+                memcpy(&alen, req.data() + pos, 4);
+                pos += 4 + alen;
+            }
+            std::string_view last(req.data() + pos - alen, alen);
+            if (last == "quit")
+            {
+                break;
+            }
+            std::string res;
+            put_res(res, ser_str(last));
+            assert(write(fd, res.data(), res.size()) == (ssize_t)res.size());
+        }
+        close(fd);
+    }
+}
+
+// KVClient reconnects a lost connection for the calls after it
+static void test_client_reconnect()
+{
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd >= 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    assert(bind(lfd, (const sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(lfd, 4) == 0);
+    assert(getsockname(lfd, (sockaddr *)&addr, &addrlen) == 0);
+    std::thread server(echo_server, lfd, 2);
+    {
+        KVClient client("127.0.0.1", ntohs(addr.sin_port), 1);
+        KVReply reply = client.call({"echo", "a"}).get();
+        assert(reply.value.type == SER_STR && reply.value.str == "a");
+        reply = client.call({"quit"}).get();
+        assert(reply.value.type == SER_ERR && reply.value.code == k_kv_err_conn);
+        for (const char *s : {"b", "c"})
+        {
+            reply = client.call({"echo", s}).get();
+            assert(reply.value.type == SER_STR && reply.value.str == s);
+        }
+    }
+    server.join();
+    close(lfd);
+}
+
+// KVClient that cannot set up its event loop answers every call with an
+// error rather than hanging
+static void test_client_no_fds()
+{
+    struct rlimit old;
+    assert(getrlimit(RLIMIT_NOFILE, &old) == 0);
+    struct rlimit low = old;
+    low.rlim_cur = 3; // only stdin, stdout and stderr
+    assert(setrlimit(RLIMIT_NOFILE, &low) == 0);
+    {
+        KVClient client("127.0.0.1", 1, 2);
+        KVReply reply = client.call({"get", "a"}).get();
+        assert(reply.value.type == SER_ERR && reply.value.code == k_kv_err_conn);
+        reply = client.call({"get", "b"}).get();
+        assert(reply.value.type == SER_ERR && reply.value.code == k_kv_err_conn);
+    }
+    assert(setrlimit(RLIMIT_NOFILE, &old) == 0);
+}
+
+int main()
+{
+    test_decode();
+    test_encode();
+    test_conn();
+    test_client_refused();
+    test_client_reconnect();
+    test_client_no_fds();
+    return 0;
+}
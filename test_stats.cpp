@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "stats.h"
+
+// Percentiles of the histogram against the exact ones of the sorted values
+static void check(std::vector<uint64_t> vals)
+{
+    Histogram h;
+    for (uint64_t v : vals)
+    {
+        h.record(v);
+    }
+    std::sort(vals.begin(), vals.end());
+    assert(h.count == vals.size());
+    assert(h.max == vals.back());
+    for (double p : {0.0, 0.1, 0.5, 0.9, 0.99, 0.999, 1.0})
+    {
+        size_t rank = std::max<size_t>(1, (size_t)(p * vals.size() + 0.999999));
+        uint64_t want = vals[rank - 1];
+        uint64_t got = h.percentile(p);
+        // never below the value, and above it by at most one bucket width
+        assert(got >= want);
+        assert(got - want <= want / k_hist_sub);
+    }
+}
+
+int main()
+{
+    // buckets cover every value once and in order
+    uint64_t prev = 0;
+    for (size_t i = 1; i < k_hist_buckets; i++)
+    {
+        uint64_t hi = hist_bucket_max(i);
+        assert(hi > prev);
+        assert(hist_bucket(prev + 1) == i);
+        assert(hist_bucket(hi) == i);
+        prev = hi;
+    }
+    assert(hist_bucket(0) == 0);
+    assert(hist_bucket(UINT64_MAX) == k_hist_buckets - 1);
+
+    Histogram empty;
+    assert(empty.percentile(0.99) == 0);
+
+    srand(42);
+    std::vector<uint64_t> vals;
+    for (size_t i = 0; i < 100000; i++)
+    {
+        vals.push_back(rand() % 100);
+    }
+    check(vals);
+    vals.clear();
+    for (size_t i = 0; i < 100000; i++)
+    {
+        // long tailed, like request latencies
+        vals.push_back((uint64_t)rand() << (rand() % 8));
+    }
+    check(vals);
+
+    // merged histograms report the combined values
+    Histogram a, b, sum;
+    for (uint64_t v = 1; v <= 1000; v++)
+    {
+        (v % 2 ? a : b).record(v);
+    }
+    sum.merge(a);
+    sum.merge(b);
+    assert(sum.count == 1000);
+    assert(sum.max == 1000);
+    assert(sum.sum == 500500);
+    uint64_t p50 = sum.percentile(0.5);
+    assert(p50 >= 500 && p50 <= 500 + 500 / k_hist_sub);
+    return 0;
+}
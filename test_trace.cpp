@@ -0,0 +1,94 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "trace.h"
+
+// One thread pushes numbered records while another pops them: the
+// consumer sees every record that was not dropped, in order
+static void test_spsc(uint64_t n)
+{
+    TraceRing *ring = new TraceRing();
+    uint64_t pushed = 0;
+    uint64_t retries = 0; // of the end marker, also counted as dropped
+    std::thread producer([&]() {
+        TraceRecord rec;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            rec.time_us = i;
+            pushed += ring->push(rec) ? 1 : 0;
+        }
+        rec.time_us = UINT64_MAX; // the end
+        while (!ring->push(rec))
+        {
+            retries++;
+        }
+    });
+
+    TraceRecord rec;
+    uint64_t popped = 0;
+    uint64_t last = 0;
+    while (true)
+    {
+        if (!ring->pop(&rec))
+        {
+            continue;
+        }
+        if (rec.time_us == UINT64_MAX)
+        {
+            break;
+        }
+        assert(popped == 0 || rec.time_us > last);
+        last = rec.time_us;
+        popped++;
+    }
+    producer.join();
+    assert(popped == pushed);
+    assert(pushed + ring->dropped == n + retries);
+    delete ring;
+}
+
+int main()
+{
+    // a full ring drops instead of overwriting
+    TraceRing *ring = new TraceRing();
+    TraceRecord rec;
+    for (size_t i = 0; i < k_trace_ring; i++)
+    {
+        rec.time_us = i;
+        assert(ring->push(rec));
+    }
+    assert(!ring->push(rec));
+    assert(ring->dropped == 1);
+    for (size_t i = 0; i < k_trace_ring; i++)
+    {
+        assert(ring->pop(&rec) && rec.time_us == i);
+    }
+    assert(!ring->pop(&rec));
+    delete ring;
+
+    test_spsc(1000);
+    test_spsc(1000000);
+
+    // arguments are kept as they fit and escaped when formatted
+    std::string_view args[] = {"set", "a \"b\"", std::string_view("\x01\n", 2)};
+    rec.ticks = 2000;
+    rec.worker = 1;
+    rec.fd = 7;
+    rec.time_us = 1000002;
+    rec.set_args(args, 3);
+    std::string line;
+    trace_format(rec, 1.0, line);
+    assert(line == "1.000002 worker=1 fd=7 usec=2.000 argc=3 \"set\" \"a \\\"b\\\"\" \"\\x01\\x0a\"\n");
+
+    std::string big(1000, 'x');
+    std::string_view long_args[] = {"get", big, "more"};
+    rec.set_args(long_args, 3);
+    assert(rec.cut && rec.len == k_trace_args);
+    line.clear();
+    trace_format(rec, 1.0, line);
+    assert(line.size() > 4 && line.compare(line.size() - 5, 5, " ...\n") == 0);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "trace.h"
+
+void TraceRecord::set_args(const std::string_view *argv, size_t n)
+{
+    argc = (uint16_t)std::min<size_t>(n, UINT16_MAX);
+    len = 0;
+    cut = false;
+    for (size_t i = 0; i < n && !cut && (size_t)len + 1 < k_trace_args; i++)
+    {
+        size_t room = k_trace_args - len - 1;
+        size_t keep = std::min({argv[i].size(), room, (size_t)255});
+        args[len++] = (char)keep;
+        memcpy(&args[len], argv[i].data(), keep);
+        len += (uint16_t)keep;
+        cut = keep < argv[i].size();
+    }
+}
+
+void trace_format(const TraceRecord &rec, double ticks_per_ns, std::string &out)
+{
+    char head[128];
+    snprintf(head, sizeof(head), "%lu.%06lu worker=%u fd=%d usec=%.3f argc=%u",
+             (unsigned long)(rec.time_us / 1000000), (unsigned long)(rec.time_us % 1000000),
+             rec.worker, rec.fd, (double)rec.ticks / ticks_per_ns / 1000, rec.argc);
+    out.append(head);
+    size_t kept = 0;
+    for (size_t pos = 0; pos < rec.len; kept++)
+    {
+        size_t n = (uint8_t)rec.args[pos++];
+        out.append(" \"");
+        for (size_t i = pos; i < pos + n; i++)
+        {
+            uint8_t c = (uint8_t)rec.args[i];
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back((char)c);
+            }
+            else if (c < 0x20 || c > 0x7e)
+            {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\x%02x", c);
+                out.append(esc);
+            }
+            else
+            {
+                out.push_back((char)c);
+            }
+        }
+        out.push_back('"');
+        pos += n;
+    }
+    if (rec.cut || kept < rec.argc)
+    {
+        out.append(" ...");
+    }
+    out.push_back('\n');
+}
+
+bool TraceRing::push(const TraceRecord &rec)
+{
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == k_trace_ring)
+    {
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+    slots[h % k_trace_ring] = rec;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+bool TraceRing::pop(TraceRecord *rec)
+{
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+    *rec = slots[t % k_trace_ring];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
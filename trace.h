@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+
+#ifndef TRACE_H
+#define TRACE_H
+
+const size_t k_trace_ring = 4096; // records per ring, a power of two
+const size_t k_trace_args = 96;   // bytes of packed arguments per record
+
+// One request as recorded by a worker. The arguments are packed as a u8
+// length and the bytes, as many as fit, and at most 255 bytes of each.
+struct TraceRecord
+{
+    uint64_t time_us = 0; // wall clock when the command finished
+    uint64_t ticks = 0;   // time spent, see tsc_now()
+    uint32_t worker = 0;
+    int32_t fd = -1;      // of the client connection
+    uint16_t argc = 0;    // arguments of the request, not just those kept
+    uint16_t len = 0;     // used bytes of args
+    bool cut = false;     // the last kept argument is incomplete
+    char args[k_trace_args];
+
+    void set_args(const std::string_view *argv, size_t n);
+};
+
+// Appends the record as one line of text: time, worker, fd, duration and
+// the kept arguments quoted, with unprintable bytes escaped
+void trace_format(const TraceRecord &rec, double ticks_per_ns, std::string &out);
+
+// Lock-free ring of records with one producer and one consumer. When the
+// consumer falls behind, new records are dropped and counted rather than
+// blocking the producer.
+class TraceRing
+{
+public:
+    TraceRecord slots[k_trace_ring];
+    alignas(64) std::atomic<uint64_t> head{0}; // next slot to write
+    alignas(64) std::atomic<uint64_t> tail{0}; // next slot to read
+    std::atomic<uint64_t> dropped{0};
+
+    // only from the producer, false if the ring is full
+    bool push(const TraceRecord &rec);
+    // only from the consumer, false if the ring is empty
+    bool pop(TraceRecord *rec);
+};
+
+#endif
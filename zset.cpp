@@ -0,0 +1,218 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zset.h"
+#include "hash.h"
+
+#define container_of(ptr, type, member) ({                  \
+    typeof(  ((type *)0)->member ) *__mptr = ptr;           \
+    (type *)( (size_t) __mptr - offsetof(type, member)); })
+
+static ZNode *znode_new(const char *name, size_t len, double score)
+{
+    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
+    assert(node);
+    avl_init(&node->tree);
+    node->hmap.next = NULL;
+    node->hmap.hcode = str_hash((const uint8_t *)name, len);
+    node->score = score;
+    node->len = len;
+    memcpy(&node->name[0], name, len);
+    return node;
+}
+
+void znode_del(ZNode *node)
+{
+    free(node);
+}
+
+static size_t min(size_t lhs, size_t rhs)
+{
+    return lhs < rhs ? lhs : rhs;
+}
+
+// compare by the (score, name) tuple
+static bool zless(AVLNode *lhs, double score, const char *name, size_t len)
+{
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    if (zl->score != score)
+    {
+        return zl->score < score;
+    }
+    int rv = memcmp(zl->name, name, min(zl->len, len));
+    if (rv != 0)
+    {
+        return rv < 0;
+    }
+    return zl->len < len;
+}
+
+static bool zless(AVLNode *lhs, AVLNode *rhs)
+{
+    ZNode *zr = container_of(rhs, ZNode, tree);
+    return zless(lhs, zr->score, zr->name, zr->len);
+}
+
+static void tree_add(ZSet *zset, ZNode *node)
+{
+    if (!zset->tree)
+    {
+        zset->tree = &node->tree;
+        return;
+    }
+
+    AVLNode *cur = zset->tree;
+    while (true)
+    {
+        AVLNode **from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+        if (!*from)
+        {
+            *from = &node->tree;
+            node->tree.parent = cur;
+            zset->tree = avl_fix(&node->tree);
+            break;
+        }
+        cur = *from;
+    }
+}
+
+// update the score of an existing node
+static void zset_update(ZSet *zset, ZNode *node, double score)
+{
+    if (node->score == score)
+    {
+        return;
+    }
+    zset->tree = avl_del(&node->tree);
+    node->score = score;
+    avl_init(&node->tree);
+    tree_add(zset, node);
+}
+
+// add a new (score, name) tuple, or update the score of the existing tuple
+bool zset_add(ZSet *zset, const char *name, size_t len, double score)
+{
+    ZNode *node = zset_lookup(zset, name, len);
+    if (node)
+    {
+        zset_update(zset, node, score);
+        return false;
+    }
+    node = znode_new(name, len, score);
+    zset->mem += sizeof(ZNode) + len;
+    zset->hmap.hm_insert(&node->hmap);
+    tree_add(zset, node);
+    return true;
+}
+
+static bool hcmp(HNode *node, const HKey *key)
+{
+    ZNode *znode = container_of(node, ZNode, hmap);
+    return znode->len == key->len && memcmp(znode->name, key->data, key->len) == 0;
+}
+
+static HKey name_key(const char *name, size_t len)
+{
+    HKey key;
+    key.data = (const uint8_t *)name;
+    key.len = len;
+    key.hcode = str_hash(key.data, len);
+    return key;
+}
+
+// lookup by name
+ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
+{
+    if (!zset->tree)
+    {
+        return NULL;
+    }
+    HKey key = name_key(name, len);
+    HNode *found = zset->hmap.hm_lookup(&key, &hcmp);
+    return found ? container_of(found, ZNode, hmap) : NULL;
+}
+
+// deletion by name, the caller frees the node with znode_del()
+ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
+{
+    if (!zset->tree)
+    {
+        return NULL;
+    }
+    HKey key = name_key(name, len);
+    HNode *found = zset->hmap.hm_pop(&key, &hcmp);
+    if (!found)
+    {
+        return NULL;
+    }
+    ZNode *node = container_of(found, ZNode, hmap);
+    zset->tree = avl_del(&node->tree);
+    zset->mem -= sizeof(ZNode) + node->len;
+    return node;
+}
+
+// find the first (score, name) tuple that is >= key, then move by offset
+ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len, int64_t offset)
+{
+    AVLNode *found = NULL;
+    AVLNode *cur = zset->tree;
+    while (cur)
+    {
+        if (zless(cur, score, name, len))
+        {
+            cur = cur->right;
+        }
+        else
+        {
+            found = cur; // candidate
+            cur = cur->left;
+        }
+    }
+    if (!found)
+    {
+        return NULL;
+    }
+    // O(log n) thanks to the subtree counts
+    found = avl_offset(found, offset);
+    return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+int64_t zset_rank(ZSet *zset, ZNode *node)
+{
+    (void)zset;
+    return avl_rank(&node->tree);
+}
+
+ZNode *znode_offset(ZNode *node, int64_t offset)
+{
+    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
+    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+ZNode *znode_next(ZNode *node)
+{
+    AVLNode *tnode = avl_next(&node->tree);
+    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+static void tree_dispose(AVLNode *node)
+{
+    if (!node)
+    {
+        return;
+    }
+    tree_dispose(node->left);
+    tree_dispose(node->right);
+    znode_del(container_of(node, ZNode, tree));
+}
+
+// destroy the zset
+void zset_dispose(ZSet *zset)
+{
+    tree_dispose(zset->tree);
+    zset->tree = NULL;
+    zset->mem = 0;
+    free(zset->hmap.ht1.tab);
+    free(zset->hmap.ht2.tab);
+    zset->hmap = HMap();
+}
@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "avl.h"
+#include "hashtable.h"
+
+#ifndef ZSET_H
+#define ZSET_H
+
+// Sorted set: the AVL tree orders members by (score, name) and the hash
+// map finds a member by name
+struct ZSet
+{
+    AVLNode *tree = NULL;
+    HMap hmap;
+    size_t mem = 0; // bytes held by the members, for memory accounting
+};
+
+struct ZNode
+{
+    AVLNode tree;
+    HNode hmap;
+    double score = 0;
+    size_t len = 0;
+    char name[0];
+};
+
+bool zset_add(ZSet *zset, const char *name, size_t len, double score);
+ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
+ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
+ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len, int64_t offset);
+int64_t zset_rank(ZSet *zset, ZNode *node);
+ZNode *znode_offset(ZNode *node, int64_t offset);
+ZNode *znode_next(ZNode *node);
+void znode_del(ZNode *node);
+void zset_dispose(ZSet *zset);
+
+#endif